@@ -0,0 +1,228 @@
+// Benchmark of the tagtagtag-ears driver on simulated ears, in virtual time.
+//
+// Runs '>' and '<' for every pair of start and target positions, and '!'
+// (position detection) from every hole and from halfway to the next one,
+// each from a freshly loaded driver. The left ear is calibrated by the
+// start-up test turn once, and this calibration is restored with the start
+// position for each run. Prints one CSV line per run:
+// - command, from (start position, .5 if between holes), to (target, or for
+//   '!' the position to detect: the start hole, or the next one if between)
+// - position: final position reported by the driver
+// - final_hole: hole the ear stopped on, -1 if between holes
+// - error: distance from the ear to to, in holes
+// - time_ms: from command start to completion
+// - motors_on_ms, corrections (correction steps after overshoots), flags (EAR_DONE_*)
+
+#include <errno.h>
+#include <math.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../tagtagtag-ears.h"
+#include "sim.h"
+
+#define RUN_TIMEOUT_NS (60LL * 1000000000)
+
+struct result {
+    int position;
+    int final_hole;
+    double error;
+    double time_ms;
+    double motors_on_ms;
+    int corrections;
+    int flags;
+};
+
+struct summary {
+    unsigned int runs;
+    unsigned int failures;          // timeout, wrong or unknown position
+    double time_ms;
+    double max_time_ms;
+    double motors_on_ms;
+    unsigned int corrections;
+    double max_error;
+};
+
+static struct sim_config config;
+static char calibration[64];
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "usage: %s [-s seed] [-p] [-c seconds] [-P name=value]...\n"
+        "  -s seed         seed of random jitter (default: 1)\n"
+        "  -p              drive motors with PWMs instead of GPIOs\n"
+        "  -c seconds      time constant of coasting (default: 0.06, 0.3 hole at full speed)\n"
+        "  -P name=value   set module parameter before loading the driver\n",
+        name);
+}
+
+// Calibrate left ear with the start-up test turn.
+static int calibrate(void) {
+    struct sim_config test_config = config;
+    ssize_t result;
+    int err;
+    test_config.fast_start = 0;
+    err = sim_start(&test_config);
+    if (err) {
+        return err;
+    }
+    sim_run_until_idle(RUN_TIMEOUT_NS);
+    result = sim_attr_read(0, "calibration", calibration, sizeof(calibration));
+    sim_stop(0);
+    if (result < 0) {
+        return result;
+    }
+    return 0;
+}
+
+// Signed distance from the ear to a hole, in holes (slots).
+static double hole_error(int ear, int position) {
+    double error = sim_angle(ear) - sim_hole_angle(position);
+    if (error > SIM_NUM_SLOTS / 2) {
+        error -= SIM_NUM_SLOTS;
+    } else if (error < -SIM_NUM_SLOTS / 2) {
+        error += SIM_NUM_SLOTS;
+    }
+    return error;
+}
+
+// Run a command on the left ear, starting at given angle with known position
+// (or -1).
+static int run(double angle, int position, const char *command, size_t len, int target, struct result *result) {
+    unsigned long hole_period_us, gap_period_us, stop_lead_us;
+    struct ear_event event;
+    char value[64];
+    int err;
+    int fd;
+
+    memset(result, 0, sizeof(*result));
+    result->position = -1;
+    config.angle[0] = angle;
+    err = sim_start(&config);
+    if (err) {
+        return err;
+    }
+    sscanf(calibration, "%lu %lu %lu", &hole_period_us, &gap_period_us, &stop_lead_us);
+    snprintf(value, sizeof(value), "%lu %lu %lu %d", hole_period_us, gap_period_us, stop_lead_us, position);
+    err = sim_attr_write(0, "calibration", value);
+    if (err < 0) {
+        goto stop;
+    }
+    fd = sim_open(0, 0);
+    if (fd < 0) {
+        err = fd;
+        goto stop;
+    }
+    if (sim_write(fd, "e", 1) != 1 || sim_write(fd, command, len) != (ssize_t) len) {
+        err = -EIO;
+        goto stop;
+    }
+    err = sim_run_until_idle(RUN_TIMEOUT_NS);
+    while (sim_poll(fd) & POLLIN && sim_read(fd, &event, sizeof(event)) == sizeof(event)) {
+        if (event.type == EAR_EVENT_DONE) {
+            result->position = event.position;
+            result->time_ms = (event.time_ns - event.start_time_ns) / 1e6;
+            result->motors_on_ms = event.motors_on_us / 1e3;
+            result->flags = event.flags;
+        }
+    }
+    result->corrections = sim_corrections(0);
+    result->final_hole = sim_hole(0);
+    result->error = hole_error(0, target);
+stop:
+    sim_stop(0);
+    return err;
+}
+
+static void report(const char *command, double from, int to, const struct result *result, int err, struct summary *summary) {
+    printf("%s,%g,%d,%d,%d,%.3f,%.1f,%.1f,%d,0x%02x\n", command, from, to, result->position, result->final_hole,
+        result->error, result->time_ms, result->motors_on_ms, result->corrections, result->flags);
+    summary->runs++;
+    if (err || result->position != to || result->final_hole != result->position) {
+        summary->failures++;
+    }
+    summary->time_ms += result->time_ms;
+    if (result->time_ms > summary->max_time_ms) {
+        summary->max_time_ms = result->time_ms;
+    }
+    summary->motors_on_ms += result->motors_on_ms;
+    summary->corrections += result->corrections;
+    if (fabs(result->error) > summary->max_error) {
+        summary->max_error = fabs(result->error);
+    }
+}
+
+static void print_summary(const char *command, const struct summary *summary) {
+    fprintf(stderr, "%s: %u runs, %u failed, time %.1f ms (max %.1f), motors on %.1f ms, %.2f corrections, max error %.3f\n",
+        command, summary->runs, summary->failures, summary->time_ms / summary->runs, summary->max_time_ms,
+        summary->motors_on_ms / summary->runs, (double) summary->corrections / summary->runs, summary->max_error);
+}
+
+int main(int argc, char **argv) {
+    static const char directions[] = { '>', '<' };
+    struct summary summaries[3] = { { 0 } };
+    struct result result;
+    int opt;
+    int err;
+    int ix;
+
+    sim_default_config(&config);
+    while ((opt = getopt(argc, argv, "s:pc:P:h")) != -1) {
+        char name[64];
+        long value;
+        switch (opt) {
+            case 's':
+                config.seed = strtoul(optarg, NULL, 0);
+                break;
+            case 'p':
+                config.pwm = 1;
+                break;
+            case 'c':
+                config.coast_tau = strtod(optarg, NULL);
+                break;
+            case 'P':
+                if (sscanf(optarg, "%63[^=]=%ld", name, &value) != 2 || sim_param_set(name, value)) {
+                    fprintf(stderr, "cannot set %s\n", optarg);
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return opt != 'h';
+        }
+    }
+
+    err = calibrate();
+    if (err) {
+        fprintf(stderr, "calibration failed: %s\n", strerror(-err));
+        return 1;
+    }
+    config.fast_start = 1;
+
+    printf("command,from,to,position,final_hole,error,time_ms,motors_on_ms,corrections,flags\n");
+    for (ix = 0; ix < 2; ix++) {
+        char command[3] = { directions[ix] };
+        int from, to;
+        for (from = 0; from < SIM_NUM_HOLES; from++) {
+            for (to = 0; to < SIM_NUM_HOLES; to++) {
+                command[1] = to;
+                err = run(sim_hole_angle(from), from, command, 2, to, &result);
+                report(command[0] == '>' ? ">" : "<", from, to, &result, err, &summaries[ix]);
+            }
+        }
+    }
+    for (ix = 0; ix < 2 * SIM_NUM_HOLES; ix++) {
+        int from = ix >> 1;
+        double offset = (ix & 1) ? 0.5 : 0.0;
+        int to = (ix & 1) ? (from + 1) % SIM_NUM_HOLES : from;
+        err = run(sim_hole_angle(from) + offset, -1, "!", 1, to, &result);
+        report("!", from + offset, to, &result, err, &summaries[2]);
+    }
+    print_summary(">", &summaries[0]);
+    print_summary("<", &summaries[1]);
+    print_summary("!", &summaries[2]);
+    return 0;
+}
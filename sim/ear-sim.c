@@ -0,0 +1,254 @@
+// Run the tagtagtag-ears driver against simulated ears, following a script
+// given as arguments. See Test.md.
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <unistd.h>
+
+#include "../tagtagtag-ears.h"
+#include "sim.h"
+
+static int fds[SIM_COMBINED_MINOR + 1] = { -1, -1, -1 };
+
+static void usage(const char *name) {
+    fprintf(stderr,
+        "usage: %s [-v]... [-s seed] [-p] [-c seconds] [-f] [-a ear=angle] [-P name=value]... [step]...\n"
+        "  -v              print driver errors, warnings, info, debug messages\n"
+        "  -s seed         seed of random jitter (default: 1)\n"
+        "  -p              drive motors with PWMs instead of GPIOs\n"
+        "  -c seconds      time constant of coasting (default: 0.06, 0.3 hole at full speed)\n"
+        "  -f              set the fast-start device tree property\n"
+        "  -a ear=angle    initial angle of ear 0 or 1, in holes (default: 0)\n"
+        "  -P name=value   set module parameter before loading the driver\n"
+        "steps (default: idle status):\n"
+        "  write:minor:bytes   write bytes to /dev/ear<minor> (2: /dev/ears), with \\xHH escapes\n"
+        "  read:minor          read available bytes\n"
+        "  events:minor        read available events (after writing 'e')\n"
+        "  close:minor         close the device, next step using it opens it again\n"
+        "  run:ms              run for ms milliseconds\n"
+        "  idle                run until ears are idle and stopped\n"
+        "  hold:ear / release:ear\n"
+        "  turn:ear:speed:ms   turn ear by hand at speed holes per second for ms milliseconds\n"
+        "  param:name=value    set module parameter\n"
+        "  attr:minor:name[=value]  read or write sysfs attribute\n"
+        "  status              print driver and physical state of ears\n",
+        name);
+}
+
+static void print_time(void) {
+    long long now_us = sim_time_ns() / 1000;
+    printf("[%5lld.%06lld] ", now_us / 1000000, now_us % 1000000);
+}
+
+static int get_fd(int minor) {
+    if (minor < 0 || minor > SIM_COMBINED_MINOR) {
+        return -ENODEV;
+    }
+    if (fds[minor] < 0) {
+        fds[minor] = sim_open(minor, 0);
+    }
+    return fds[minor];
+}
+
+// Decode \xHH and \\ escapes.
+static size_t unescape(const char *str, char *buffer) {
+    size_t len = 0;
+    while (*str) {
+        if (str[0] == '\\' && str[1] == 'x' && str[2] && str[3]) {
+            char hex[3] = { str[2], str[3], 0 };
+            buffer[len++] = (char) strtoul(hex, NULL, 16);
+            str += 4;
+        } else if (str[0] == '\\' && str[1] == '\\') {
+            buffer[len++] = '\\';
+            str += 2;
+        } else {
+            buffer[len++] = *str++;
+        }
+    }
+    return len;
+}
+
+static void print_status(void) {
+    int ix;
+    for (ix = 0; ix < SIM_NUM_EARS; ix++) {
+        struct sim_ear_stats stats;
+        char calibration[64] = "-";
+        sim_stats(ix, &stats);
+        if (sim_attr_read(ix, "calibration", calibration, sizeof(calibration)) > 0) {
+            calibration[strcspn(calibration, "\n")] = 0;
+        }
+        print_time();
+        printf("ear%d: %s, position %d, on hole %d (angle %.2f), calibration %s, %u edges, %u motor starts, motors on %lld ms\n",
+            ix, sim_state(ix), sim_position(ix), sim_hole(ix), sim_angle(ix), calibration,
+            stats.edges, stats.motor_starts, (long long) stats.motors_on_ns / 1000000);
+    }
+}
+
+static int set_param(const char *assignment) {
+    char name[64];
+    long value;
+    int err;
+    if (sscanf(assignment, "%63[^=]=%ld", name, &value) != 2) {
+        return -EINVAL;
+    }
+    err = sim_param_set(name, value);
+    if (err) {
+        fprintf(stderr, "cannot set %s: %s\n", name, strerror(-err));
+    }
+    return err;
+}
+
+static int step(const char *arg) {
+    char buffer[256];
+    double speed;
+    int minor, ear, ms, n;
+    ssize_t result;
+
+    if (sscanf(arg, "write:%d:%n", &minor, &n) == 1) {
+        size_t len = unescape(arg + n, buffer);
+        result = sim_write(get_fd(minor), buffer, len);
+        print_time();
+        printf("write %d: %zd\n", minor, result);
+    } else if (sscanf(arg, "read:%d", &minor) == 1) {
+        int fd = get_fd(minor);
+        while (sim_poll(fd) & POLLIN) {
+            result = sim_read(fd, buffer, 1);
+            if (result <= 0) {
+                break;
+            }
+            print_time();
+            if (buffer[0] == 'm' || buffer[0] == 'b' || buffer[0] == 'r') {
+                printf("read %d: %c\n", minor, buffer[0]);
+            } else {
+                printf("read %d: %d\n", minor, (signed char) buffer[0]);
+            }
+        }
+    } else if (sscanf(arg, "events:%d", &minor) == 1) {
+        int fd = get_fd(minor);
+        struct ear_event event;
+        while (sim_poll(fd) & POLLIN) {
+            if (sim_read(fd, &event, sizeof(event)) != sizeof(event)) {
+                break;
+            }
+            print_time();
+            printf("event %d: '%c' sequence %u position %d", minor, event.type, event.sequence, event.position);
+            if (event.type == EAR_EVENT_DONE) {
+                printf(" command '%c' flags 0x%02x took %llu ms, motors on %u ms",
+                    event.command, event.flags, (unsigned long long) (event.time_ns - event.start_time_ns) / 1000000,
+                    event.motors_on_us / 1000);
+            }
+            printf("\n");
+        }
+    } else if (sscanf(arg, "close:%d", &minor) == 1 && minor >= 0 && minor <= SIM_COMBINED_MINOR) {
+        if (fds[minor] >= 0) {
+            sim_close(fds[minor]);
+            fds[minor] = -1;
+        }
+    } else if (sscanf(arg, "run:%d", &ms) == 1) {
+        sim_run_for((int64_t) ms * 1000000);
+    } else if (strcmp(arg, "idle") == 0) {
+        if (sim_run_until_idle(60LL * 1000000000)) {
+            print_time();
+            printf("ears are not idle after 60 s\n");
+        }
+    } else if (sscanf(arg, "hold:%d", &ear) == 1 && ear >= 0 && ear < SIM_NUM_EARS) {
+        sim_hold(ear, 1);
+    } else if (sscanf(arg, "release:%d", &ear) == 1 && ear >= 0 && ear < SIM_NUM_EARS) {
+        sim_hold(ear, 0);
+    } else if (sscanf(arg, "turn:%d:%lf:%d", &ear, &speed, &ms) == 3 && ear >= 0 && ear < SIM_NUM_EARS) {
+        sim_turn(ear, speed * SIM_NUM_SLOTS / SIM_NUM_HOLES);
+        sim_run_for((int64_t) ms * 1000000);
+        sim_turn(ear, 0);
+    } else if (strncmp(arg, "param:", 6) == 0) {
+        set_param(arg + 6);
+    } else if (sscanf(arg, "attr:%d:%n", &minor, &n) == 1) {
+        const char *value = strchr(arg + n, '=');
+        char name[64];
+        snprintf(name, sizeof(name), "%.*s", value ? (int) (value - arg - n) : (int) strlen(arg + n), arg + n);
+        print_time();
+        if (value) {
+            printf("attr %d %s: %zd\n", minor, name, sim_attr_write(minor, name, value + 1));
+        } else {
+            result = sim_attr_read(minor, name, buffer, sizeof(buffer));
+            if (result < 0) {
+                printf("attr %d %s: %zd\n", minor, name, result);
+            } else {
+                printf("attr %d %s: %s", minor, name, buffer);
+            }
+        }
+    } else if (strcmp(arg, "status") == 0) {
+        print_status();
+    } else {
+        fprintf(stderr, "unknown step: %s\n", arg);
+        return -EINVAL;
+    }
+    return 0;
+}
+
+int main(int argc, char **argv) {
+    struct sim_config config;
+    int err;
+    int opt;
+    int ix;
+
+    sim_default_config(&config);
+    while ((opt = getopt(argc, argv, "vs:pfc:a:P:h")) != -1) {
+        int ear;
+        double angle;
+        switch (opt) {
+            case 'v':
+                sim_verbose++;
+                break;
+            case 's':
+                config.seed = strtoul(optarg, NULL, 0);
+                break;
+            case 'p':
+                config.pwm = 1;
+                break;
+            case 'c':
+                config.coast_tau = strtod(optarg, NULL);
+                break;
+            case 'f':
+                config.fast_start = 1;
+                break;
+            case 'a':
+                if (sscanf(optarg, "%d=%lf", &ear, &angle) != 2 || ear < 0 || ear >= SIM_NUM_EARS) {
+                    usage(argv[0]);
+                    return 1;
+                }
+                // Fractional angles are between holes.
+                config.angle[ear] = sim_hole_angle((int) angle) + (angle - (int) angle);
+                break;
+            case 'P':
+                if (set_param(optarg)) {
+                    return 1;
+                }
+                break;
+            default:
+                usage(argv[0]);
+                return opt != 'h';
+        }
+    }
+
+    err = sim_start(&config);
+    if (err) {
+        fprintf(stderr, "probe failed: %s\n", strerror(-err));
+        return 1;
+    }
+    if (optind == argc) {
+        step("idle");
+        step("status");
+    }
+    for (ix = optind; ix < argc; ix++) {
+        if (step(argv[ix])) {
+            sim_stop(0);
+            return 1;
+        }
+    }
+    sim_stop(1);
+    return 0;
+}
@@ -0,0 +1,28 @@
+// Run the KUnit suite of the tagtagtag-ears driver (tagtagtag-ears-test.c)
+// in userspace. See Test.md.
+
+#include <stdio.h>
+#include <unistd.h>
+
+#include "sim.h"
+
+int main(int argc, char **argv) {
+    int failures;
+    int opt;
+
+    while ((opt = getopt(argc, argv, "vh")) != -1) {
+        switch (opt) {
+            case 'v':
+                sim_verbose++;
+                break;
+            default:
+                fprintf(stderr, "usage: %s [-v]...\n  -v              print driver errors, warnings, info, debug messages\n", argv[0]);
+                return opt != 'h';
+        }
+    }
+    failures = sim_kunit_run();
+    if (failures) {
+        fprintf(stderr, "%d test case(s) failed\n", failures);
+    }
+    return failures != 0;
+}
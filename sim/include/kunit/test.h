@@ -0,0 +1,76 @@
+// KUnit API for tagtagtag-ears-test.c, run by sim/ear-test.
+//
+// Suites are collected in the sim_kunit section. Failed expectations are
+// reported and mark the test as failed; failed assertions also end it.
+
+#ifndef SIM_KUNIT_TEST_H
+#define SIM_KUNIT_TEST_H
+
+#include <setjmp.h>
+
+#include "../sim-kernel.h"
+
+struct kunit {
+    const char *name;
+    void *priv;
+    int failed;
+    jmp_buf abort;
+};
+
+struct kunit_case {
+    void (*run_case)(struct kunit *test);
+    const char *name;
+};
+
+struct kunit_suite {
+    const char *name;
+    int (*init)(struct kunit *test);
+    void (*exit)(struct kunit *test);
+    struct kunit_case *test_cases;
+};
+
+#define KUNIT_CASE(test_name) { .run_case = test_name, .name = #test_name }
+
+#define kunit_test_suite(suite) \
+    static struct kunit_suite *const __sim_kunit_##suite \
+    __attribute__((used, section("sim_kunit"), aligned(sizeof(void *)))) = &suite
+
+// Freed when the test ends.
+void *kunit_kzalloc(struct kunit *test, size_t size, int gfp);
+
+void sim_kunit_fail(struct kunit *test, const char *file, int line, const char *fmt, ...)
+    __attribute__((format(printf, 4, 5)));
+void sim_kunit_abort(struct kunit *test) __attribute__((noreturn));
+
+#define SIM_KUNIT_BINARY(test, left, op, right, fail) do { \
+    const __typeof__(left) __left = (left); \
+    const __typeof__(right) __right = (right); \
+    if (!(__left op __right)) { \
+        sim_kunit_fail(test, __FILE__, __LINE__, "Expected %s %s %s, but %s == %lld, %s == %lld", \
+            #left, #op, #right, #left, (long long) __left, #right, (long long) __right); \
+        fail; \
+    } \
+} while (0)
+
+#define SIM_KUNIT_BOOL(test, condition, expected, fail) do { \
+    if (!(condition) != !(expected)) { \
+        sim_kunit_fail(test, __FILE__, __LINE__, "Expected %s to be %s", #condition, (expected) ? "true" : "false"); \
+        fail; \
+    } \
+} while (0)
+
+#define KUNIT_EXPECT_EQ(test, left, right) SIM_KUNIT_BINARY(test, left, ==, right, (void) 0)
+#define KUNIT_EXPECT_NE(test, left, right) SIM_KUNIT_BINARY(test, left, !=, right, (void) 0)
+#define KUNIT_EXPECT_LT(test, left, right) SIM_KUNIT_BINARY(test, left, <, right, (void) 0)
+#define KUNIT_EXPECT_LE(test, left, right) SIM_KUNIT_BINARY(test, left, <=, right, (void) 0)
+#define KUNIT_EXPECT_GT(test, left, right) SIM_KUNIT_BINARY(test, left, >, right, (void) 0)
+#define KUNIT_EXPECT_GE(test, left, right) SIM_KUNIT_BINARY(test, left, >=, right, (void) 0)
+#define KUNIT_EXPECT_TRUE(test, condition) SIM_KUNIT_BOOL(test, condition, 1, (void) 0)
+#define KUNIT_EXPECT_FALSE(test, condition) SIM_KUNIT_BOOL(test, condition, 0, (void) 0)
+
+#define KUNIT_ASSERT_EQ(test, left, right) SIM_KUNIT_BINARY(test, left, ==, right, sim_kunit_abort(test))
+#define KUNIT_ASSERT_NE(test, left, right) SIM_KUNIT_BINARY(test, left, !=, right, sim_kunit_abort(test))
+#define KUNIT_ASSERT_TRUE(test, condition) SIM_KUNIT_BOOL(test, condition, 1, sim_kunit_abort(test))
+#define KUNIT_ASSERT_FALSE(test, condition) SIM_KUNIT_BOOL(test, condition, 0, sim_kunit_abort(test))
+
+#endif
@@ -0,0 +1,553 @@
+// Userspace implementation of the kernel API used by tagtagtag-ears.c.
+//
+// Only what the driver uses is provided. Time is virtual: ktime, jiffies and
+// hrtimers follow sim_now_ns, which only advances when the simulator runs
+// (see sim.c). Waits run the simulator until their condition holds, so the
+// driver code is executed unmodified, in a single thread.
+
+#ifndef SIM_KERNEL_H
+#define SIM_KERNEL_H
+
+#include <errno.h>
+#include <fcntl.h>
+#include <poll.h>
+#include <stdbool.h>
+#include <stddef.h>
+#include <stdint.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <sys/types.h>
+
+#include <linux/types.h>
+
+// ========================================================================== //
+// Basic definitions
+// ========================================================================== //
+
+typedef uint8_t u8;
+typedef uint16_t u16;
+typedef uint32_t u32;
+typedef unsigned long long u64;
+typedef int8_t s8;
+typedef int16_t s16;
+typedef int32_t s32;
+typedef long long s64;
+typedef long long sim_loff_t;
+#define loff_t sim_loff_t
+
+#define __user
+#define __init
+#define __exit
+
+#define ERESTARTSYS 512
+#define EPROBE_DEFER 517
+
+#define GFP_KERNEL 0
+#define PAGE_SIZE 4096
+#define HZ 250
+#define U32_MAX UINT32_MAX
+#define NSEC_PER_SEC 1000000000LL
+#define NSEC_PER_MSEC 1000000L
+#define NSEC_PER_USEC 1000L
+#define USEC_PER_SEC 1000000L
+#define USEC_PER_MSEC 1000L
+
+#define BIT(nr) (1UL << (nr))
+#define ARRAY_SIZE(a) (sizeof(a) / sizeof((a)[0]))
+#define container_of(ptr, type, member) ((type *)((char *)(ptr) - offsetof(type, member)))
+
+#define min(x, y) ({ __typeof__(x) __x = (x); __typeof__(y) __y = (y); __x < __y ? __x : __y; })
+#define max(x, y) ({ __typeof__(x) __x = (x); __typeof__(y) __y = (y); __x > __y ? __x : __y; })
+#define min_t(type, x, y) min((type)(x), (type)(y))
+#define max_t(type, x, y) max((type)(x), (type)(y))
+#define clamp_val(val, lo, hi) min_t(__typeof__(val), max_t(__typeof__(val), val, lo), hi)
+
+#define READ_ONCE(x) (*(volatile __typeof__(x) *)&(x))
+#define WRITE_ONCE(x, val) (*(volatile __typeof__(x) *)&(x) = (val))
+
+#define MAX_ERRNO 4095
+#define IS_ERR_VALUE(x) ((unsigned long)(x) >= (unsigned long)-MAX_ERRNO)
+static inline void *ERR_PTR(long error) { return (void *)error; }
+static inline long PTR_ERR(const void *ptr) { return (long)ptr; }
+static inline bool IS_ERR(const void *ptr) { return IS_ERR_VALUE((unsigned long)ptr); }
+
+#define __ARG_PLACEHOLDER_1 0,
+#define __take_second_arg(__ignored, val, ...) val
+#define __is_defined(x) ___is_defined(x)
+#define ___is_defined(val) ____is_defined(__ARG_PLACEHOLDER_##val)
+#define ____is_defined(arg1_or_junk) __take_second_arg(arg1_or_junk 1, 0)
+#define IS_ENABLED(option) __is_defined(option)
+
+#define KERNEL_VERSION(a, b, c) (((a) << 16) + ((b) << 8) + (c))
+#define LINUX_VERSION_CODE KERNEL_VERSION(6, 1, 0)
+
+#define CONFIG_OF 1
+
+static inline unsigned long roundup_pow_of_two(unsigned long n) {
+    unsigned long result = 1;
+    while (result < n) {
+        result <<= 1;
+    }
+    return result;
+}
+
+// ========================================================================== //
+// Logging
+// ========================================================================== //
+
+struct device;
+
+// Messages up to sim_verbose are printed: 0 errors, 1 warnings, 2 info, 3 debug.
+extern int sim_verbose;
+void sim_log(int level, const struct device *dev, const char *fmt, ...) __attribute__((format(printf, 3, 4)));
+
+#define dev_err(dev, ...) sim_log(0, dev, __VA_ARGS__)
+#define dev_warn(dev, ...) sim_log(1, dev, __VA_ARGS__)
+#define dev_warn_ratelimited(dev, ...) sim_log(1, dev, __VA_ARGS__)
+#define dev_info(dev, ...) sim_log(2, dev, __VA_ARGS__)
+#define dev_dbg(dev, ...) sim_log(3, dev, __VA_ARGS__)
+
+// scnprintf returns the number of characters written.
+#define scnprintf(buf, size, ...) ({ int __n = snprintf(buf, size, __VA_ARGS__); __n >= (int)(size) ? (int)(size) - 1 : __n; })
+
+// ========================================================================== //
+// Module
+// ========================================================================== //
+
+#define THIS_MODULE NULL
+#define MODULE_PARM_DESC(name, desc)
+#define MODULE_DEVICE_TABLE(type, name)
+#define MODULE_DESCRIPTION(desc)
+#define MODULE_AUTHOR(author)
+#define MODULE_LICENSE(license)
+
+enum sim_param_type {
+    SIM_PARAM_uint,
+    SIM_PARAM_int,
+    SIM_PARAM_bool,
+};
+
+// Module parameters are collected in the sim_params section, so the
+// simulator can set them by name.
+struct sim_param {
+    const char *name;
+    void *value;
+    enum sim_param_type type;
+    unsigned int perm;
+};
+
+#define module_param(name, type, perm) \
+    static const struct sim_param __sim_param_##name \
+    __attribute__((used, section("sim_params"), aligned(sizeof(void *)))) = { #name, &name, SIM_PARAM_##type, perm }
+
+// ========================================================================== //
+// Devices
+// ========================================================================== //
+
+struct attribute {
+    const char *name;
+    unsigned short mode;
+};
+
+struct device_attribute {
+    struct attribute attr;
+    ssize_t (*show)(struct device *dev, struct device_attribute *attr, char *buf);
+    ssize_t (*store)(struct device *dev, struct device_attribute *attr, const char *buf, size_t count);
+};
+
+struct attribute_group {
+    struct attribute **attrs;
+};
+
+#define DEVICE_ATTR_RW(_name) \
+    struct device_attribute dev_attr_##_name = { { #_name, 0644 }, _name##_show, _name##_store }
+#define DEVICE_ATTR_RO(_name) \
+    struct device_attribute dev_attr_##_name = { { #_name, 0444 }, _name##_show, NULL }
+#define DEVICE_ATTR_WO(_name) \
+    struct device_attribute dev_attr_##_name = { { #_name, 0200 }, NULL, _name##_store }
+#define ATTRIBUTE_GROUPS(_name) \
+    static const struct attribute_group _name##_group = { .attrs = _name##_attrs }; \
+    static const struct attribute_group *_name##_groups[] = { &_name##_group, NULL }
+
+struct device {
+    char name[32];
+    void *driver_data;
+    dev_t devt;
+    const struct attribute_group **groups;
+};
+
+struct class {
+    const char *name;
+};
+
+struct platform_device {
+    struct device dev;
+};
+
+struct of_device_id {
+    char compatible[128];
+    const void *data;
+};
+
+#define of_match_ptr(ptr) (ptr)
+
+struct device_driver {
+    const char *name;
+    const struct of_device_id *of_match_table;
+};
+
+struct platform_driver {
+    struct device_driver driver;
+    int (*probe)(struct platform_device *pdev);
+    int (*remove)(struct platform_device *pdev);
+    void (*shutdown)(struct platform_device *pdev);
+};
+
+extern struct platform_driver *sim_platform_driver;
+#define module_platform_driver(drv) struct platform_driver *sim_platform_driver = &drv
+
+static inline void *dev_get_drvdata(const struct device *dev) { return dev->driver_data; }
+static inline void platform_set_drvdata(struct platform_device *pdev, void *data) { pdev->dev.driver_data = data; }
+static inline void *platform_get_drvdata(const struct platform_device *pdev) { return pdev->dev.driver_data; }
+
+void *devm_kzalloc(struct device *dev, size_t size, int gfp);
+void *devm_kcalloc(struct device *dev, size_t n, size_t size, int gfp);
+
+bool device_property_present(struct device *dev, const char *name);
+bool device_property_read_bool(struct device *dev, const char *name);
+
+struct class *sim_class_create(const char *name);
+#define class_create(owner, name) sim_class_create(name)
+void class_destroy(struct class *cls);
+struct device *device_create(struct class *cls, struct device *parent, dev_t devt, void *drvdata, const char *fmt, ...);
+struct device *device_create_with_groups(struct class *cls, struct device *parent, dev_t devt, void *drvdata,
+    const struct attribute_group **groups, const char *fmt, ...);
+void device_destroy(struct class *cls, dev_t devt);
+
+// ========================================================================== //
+// Character devices
+// ========================================================================== //
+
+#define MINORBITS 20
+#define MINORMASK ((1U << MINORBITS) - 1)
+#define MAJOR(dev) ((unsigned int)((dev) >> MINORBITS))
+#define MINOR(dev) ((unsigned int)((dev) & MINORMASK))
+#define MKDEV(ma, mi) (((dev_t)(ma) << MINORBITS) | (mi))
+
+struct cdev;
+typedef struct poll_table_struct poll_table;
+
+struct inode {
+    struct cdev *i_cdev;
+};
+
+struct file {
+    unsigned int f_flags;
+    void *private_data;
+    loff_t f_pos;
+};
+
+struct file_operations {
+    void *owner;
+    int (*open)(struct inode *inode, struct file *file);
+    ssize_t (*read)(struct file *file, char __user *buffer, size_t len, loff_t *offset);
+    ssize_t (*write)(struct file *file, const char __user *buffer, size_t len, loff_t *offset);
+    int (*release)(struct inode *inode, struct file *file);
+    unsigned int (*poll)(struct file *file, poll_table *wait);
+};
+
+struct cdev {
+    const struct file_operations *ops;
+    dev_t dev;
+};
+
+int alloc_chrdev_region(dev_t *dev, unsigned int baseminor, unsigned int count, const char *name);
+void unregister_chrdev_region(dev_t from, unsigned int count);
+void cdev_init(struct cdev *cdev, const struct file_operations *fops);
+int cdev_add(struct cdev *cdev, dev_t dev, unsigned int count);
+void cdev_del(struct cdev *cdev);
+
+static inline unsigned long copy_to_user(void __user *to, const void *from, unsigned long n) {
+    memcpy(to, from, n);
+    return 0;
+}
+
+static inline unsigned long copy_from_user(void *to, const void __user *from, unsigned long n) {
+    memcpy(to, from, n);
+    return 0;
+}
+
+// ========================================================================== //
+// Bit operations
+// ========================================================================== //
+
+static inline void set_bit(long nr, volatile unsigned long *addr) { *addr |= BIT(nr); }
+static inline void clear_bit(long nr, volatile unsigned long *addr) { *addr &= ~BIT(nr); }
+static inline bool test_bit(long nr, const volatile unsigned long *addr) { return (*addr & BIT(nr)) != 0; }
+
+static inline bool test_and_set_bit(long nr, volatile unsigned long *addr) {
+    bool old = test_bit(nr, addr);
+    set_bit(nr, addr);
+    return old;
+}
+
+// ========================================================================== //
+// Time
+// ========================================================================== //
+
+typedef s64 ktime_t;
+
+// Virtual time, in nanoseconds.
+extern s64 sim_now_ns;
+
+static inline ktime_t ktime_get(void) { return sim_now_ns; }
+static inline ktime_t ktime_get_raw(void) { return sim_now_ns; }
+static inline u64 ktime_get_ns(void) { return sim_now_ns; }
+static inline ktime_t ktime_set(s64 secs, unsigned long nsecs) { return secs * NSEC_PER_SEC + nsecs; }
+static inline ktime_t ms_to_ktime(u64 ms) { return ms * NSEC_PER_MSEC; }
+static inline ktime_t us_to_ktime(u64 us) { return us * NSEC_PER_USEC; }
+static inline ktime_t ns_to_ktime(u64 ns) { return ns; }
+static inline ktime_t ktime_add(ktime_t a, ktime_t b) { return a + b; }
+static inline ktime_t ktime_add_us(ktime_t kt, u64 usec) { return kt + usec * NSEC_PER_USEC; }
+static inline bool ktime_after(ktime_t a, ktime_t b) { return a > b; }
+static inline s64 ktime_us_delta(ktime_t later, ktime_t earlier) { return (later - earlier) / NSEC_PER_USEC; }
+
+#define jiffies ((unsigned long)(sim_now_ns / (NSEC_PER_SEC / HZ)))
+#define time_after(a, b) ((long)((b) - (a)) < 0)
+#define time_before(a, b) time_after(b, a)
+
+static inline unsigned long msecs_to_jiffies(unsigned int ms) {
+    return ((unsigned long) ms * HZ + 999) / 1000;
+}
+
+#ifndef CLOCK_MONOTONIC
+#define CLOCK_MONOTONIC 1
+#endif
+
+enum hrtimer_restart {
+    HRTIMER_NORESTART,
+    HRTIMER_RESTART,
+};
+
+// Soft timers expire in softirq context, which the simulator does not model.
+enum hrtimer_mode {
+    HRTIMER_MODE_ABS = 0,
+    HRTIMER_MODE_REL = 1,
+    HRTIMER_MODE_SOFT = 4,
+    HRTIMER_MODE_ABS_SOFT = HRTIMER_MODE_ABS | HRTIMER_MODE_SOFT,
+    HRTIMER_MODE_REL_SOFT = HRTIMER_MODE_REL | HRTIMER_MODE_SOFT,
+};
+
+struct hrtimer {
+    enum hrtimer_restart (*function)(struct hrtimer *timer);
+    ktime_t expires;
+    bool queued;
+    struct hrtimer *sim_next;       // all initialized timers
+};
+
+void hrtimer_init(struct hrtimer *timer, clockid_t clock_id, enum hrtimer_mode mode);
+void hrtimer_start(struct hrtimer *timer, ktime_t tim, enum hrtimer_mode mode);
+int hrtimer_cancel(struct hrtimer *timer);
+int hrtimer_try_to_cancel(struct hrtimer *timer);
+u64 hrtimer_forward_now(struct hrtimer *timer, ktime_t interval);
+
+static inline bool hrtimer_is_queued(struct hrtimer *timer) { return timer->queued; }
+
+// ========================================================================== //
+// Locking and waiting
+// ========================================================================== //
+
+// There is a single thread: locks only check that the driver does not wait
+// with a lock held.
+typedef struct {
+    int held;
+} spinlock_t;
+
+extern int sim_locks_held;
+
+#define spin_lock_init(lock) ((lock)->held = 0)
+#define spin_lock(lock) ((lock)->held++, sim_locks_held++)
+#define spin_unlock(lock) ((lock)->held--, sim_locks_held--)
+#define spin_lock_irq(lock) spin_lock(lock)
+#define spin_unlock_irq(lock) spin_unlock(lock)
+#define spin_lock_bh(lock) spin_lock(lock)
+#define spin_unlock_bh(lock) spin_unlock(lock)
+#define spin_lock_irqsave(lock, flags) ((flags) = 0, spin_lock(lock))
+#define spin_unlock_irqrestore(lock, flags) ((void)(flags), spin_unlock(lock))
+
+// Wakeups are counted by the waiters they wake, as wake_up() wakes any task
+// while wake_up_interruptible() only wakes interruptible ones. A waiter
+// checks its condition again only after a matching wakeup, so a missing or
+// mismatched wakeup hangs the wait (until interrupted or timed out) as it
+// would on a kernel.
+typedef struct {
+    unsigned int wakeups;
+    unsigned int interruptible_wakeups;
+} wait_queue_head_t;
+
+#define init_waitqueue_head(wq) ((wq)->wakeups = 0, (wq)->interruptible_wakeups = 0)
+#define wake_up(wq) ((wq)->wakeups++)
+#define wake_up_interruptible(wq) ((wq)->interruptible_wakeups++)
+
+// Run the simulator until a waited condition may have changed. Returns
+// non-zero if the wait should be interrupted: nothing happens anymore for
+// too long, as if the process got a signal.
+int sim_wait_step(s64 start, s64 deadline);
+
+#define wait_event_interruptible(wq, condition) ({ \
+    s64 __start = sim_now_ns; \
+    int __ret = 0; \
+    while (!(condition)) { \
+        unsigned int __seen = (wq).wakeups + (wq).interruptible_wakeups; \
+        while (__ret == 0 && (wq).wakeups + (wq).interruptible_wakeups == __seen) { \
+            if (sim_wait_step(__start, 0)) { \
+                __ret = -ERESTARTSYS; \
+            } \
+        } \
+        if (__ret) { \
+            break; \
+        } \
+        __start = sim_now_ns; \
+    } \
+    __ret; \
+})
+
+#define wait_event_timeout(wq, condition, timeout) ({ \
+    s64 __start = sim_now_ns; \
+    s64 __deadline = __start + (s64)(timeout) * (NSEC_PER_SEC / HZ); \
+    long __ret = 1; \
+    while (!(condition)) { \
+        unsigned int __seen = (wq).wakeups; \
+        while (sim_now_ns < __deadline && (wq).wakeups == __seen) { \
+            sim_wait_step(__start, __deadline); \
+        } \
+        if ((wq).wakeups == __seen) { \
+            __ret = (condition) ? 1 : 0; \
+            break; \
+        } \
+    } \
+    __ret; \
+})
+
+static inline void poll_wait(struct file *file, wait_queue_head_t *wq, poll_table *p) {
+}
+
+// ========================================================================== //
+// FIFOs
+// ========================================================================== //
+
+// Same layout for embedded and allocated buffers. Sizes are powers of 2.
+#define DECLARE_KFIFO_PTR(fifo, type) \
+    struct { unsigned int in, out, mask; type *data; } fifo
+#define DECLARE_KFIFO(fifo, type, size) \
+    struct { unsigned int in, out, mask; type *data; type buf[size]; } fifo
+
+#define INIT_KFIFO(fifo) do { \
+    (fifo).in = (fifo).out = 0; \
+    (fifo).mask = ARRAY_SIZE((fifo).buf) - 1; \
+    (fifo).data = (fifo).buf; \
+} while (0)
+
+#define kfifo_init(fifo, buffer, size) ({ \
+    (fifo)->in = (fifo)->out = 0; \
+    (fifo)->data = (void *)(buffer); \
+    (fifo)->mask = (size) / sizeof(*(fifo)->data) - 1; \
+    0; \
+})
+
+#define kfifo_len(fifo) ((fifo)->in - (fifo)->out)
+#define kfifo_is_empty(fifo) ((fifo)->in == (fifo)->out)
+#define kfifo_is_full(fifo) (kfifo_len(fifo) > (fifo)->mask)
+#define kfifo_reset(fifo) ((fifo)->in = (fifo)->out = 0)
+#define kfifo_skip(fifo) ((fifo)->out++)
+
+#define kfifo_put(fifo, val) ({ \
+    int __ok = !kfifo_is_full(fifo); \
+    if (__ok) { \
+        (fifo)->data[(fifo)->in & (fifo)->mask] = (val); \
+        (fifo)->in++; \
+    } \
+    __ok; \
+})
+
+#define kfifo_peek(fifo, ptr) ({ \
+    int __ok = !kfifo_is_empty(fifo); \
+    if (__ok) { \
+        *(ptr) = (fifo)->data[(fifo)->out & (fifo)->mask]; \
+    } \
+    __ok; \
+})
+
+#define kfifo_get(fifo, ptr) ({ \
+    int __ok = kfifo_peek(fifo, ptr); \
+    if (__ok) { \
+        (fifo)->out++; \
+    } \
+    __ok; \
+})
+
+// ========================================================================== //
+// GPIOs, PWMs and interrupts
+// ========================================================================== //
+
+enum gpiod_flags {
+    GPIOD_IN,
+    GPIOD_OUT_LOW,
+    GPIOD_OUT_HIGH,
+};
+
+struct gpio_desc {
+    int ear;
+    int line;               // 0: forward motor, 1: backward motor, 2: encoder
+};
+
+struct gpio_descs {
+    unsigned int ndescs;
+    struct gpio_desc *desc[2];
+};
+
+struct gpio_array;
+
+struct gpio_desc *devm_gpiod_get(struct device *dev, const char *con_id, enum gpiod_flags flags);
+struct gpio_descs *devm_gpiod_get_array(struct device *dev, const char *con_id, enum gpiod_flags flags);
+int gpiod_get_value(const struct gpio_desc *desc);
+void gpiod_set_value(struct gpio_desc *desc, int value);
+int gpiod_set_array_value(unsigned int array_size, struct gpio_desc **desc_array,
+    struct gpio_array *array_info, unsigned long *value_bitmap);
+int gpiod_to_irq(const struct gpio_desc *desc);
+
+struct pwm_device {
+    int ear;
+    int line;               // 0: forward motor, 1: backward motor
+};
+
+struct pwm_state {
+    u64 period;
+    u64 duty_cycle;
+    bool enabled;
+};
+
+struct pwm_device *devm_pwm_get(struct device *dev, const char *con_id);
+void pwm_init_state(const struct pwm_device *pwm, struct pwm_state *state);
+int pwm_set_relative_duty_cycle(struct pwm_state *state, unsigned int duty_cycle, unsigned int scale);
+int pwm_apply_state(struct pwm_device *pwm, const struct pwm_state *state);
+
+typedef enum irqreturn {
+    IRQ_NONE,
+    IRQ_HANDLED,
+    IRQ_WAKE_THREAD,
+} irqreturn_t;
+
+typedef irqreturn_t (*irq_handler_t)(int irq, void *dev_id);
+
+#define IRQF_TRIGGER_FALLING 0x02
+#define IRQF_ONESHOT 0x2000
+
+// Primary handlers run in (simulated) hard interrupt context, as soon as the
+// edge occurs. Threaded handlers run after irq_latency_ns.
+int devm_request_threaded_irq(struct device *dev, unsigned int irq, irq_handler_t handler, irq_handler_t thread_fn,
+    unsigned long irqflags, const char *devname, void *dev_id);
+void devm_free_irq(struct device *dev, unsigned int irq, void *dev_id);
+
+#endif
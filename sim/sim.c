@@ -0,0 +1,949 @@
+// Simulated ears running the tagtagtag-ears driver in userspace.
+// See sim.h.
+
+#include <math.h>
+#include <setjmp.h>
+#include <stdarg.h>
+
+#include "../tagtagtag-ears.c"
+#include <kunit/test.h>
+
+#include "sim.h"
+
+#define SIM_MAJOR 240
+#define SIM_IRQ_BASE 100
+#define SIM_MAX_FILES 8
+#define SIM_PWM_PERIOD_NS 50000
+#define SIM_NOISE_PERIOD_NS (20 * NSEC_PER_MSEC)
+#define SIM_STOP_SPEED 0.02         // slots per second, below which a coasting ear stops
+#define SIM_WAIT_LIMIT_NS (300 * NSEC_PER_SEC)
+
+// ========================================================================== //
+// State
+// ========================================================================== //
+
+struct sim_ear {
+    double angle;                   // 0 to SIM_NUM_SLOTS
+    double speed;                   // slots per second
+    double edge_offsets[SIM_NUM_SLOTS][2];  // falling edge forward, backward
+    double noise;                   // current speed noise factor
+    s64 noise_until;
+    unsigned int duty[2];           // forward, backward, in %
+    int held;
+    int turning;
+    double turn_speed;
+    int high;                       // encoder level
+    struct sim_ear_stats stats;
+    struct gpio_desc encoder_gpio;
+    struct gpio_desc motor_gpio[2];
+    struct gpio_descs motor_gpios;
+    struct pwm_device motor_pwms[2];
+};
+
+struct sim_irq {
+    irq_handler_t handler;
+    irq_handler_t thread_fn;
+    void *dev_id;
+    int thread_pending;
+    s64 thread_due;
+};
+
+// Memory allocated by devm_* functions, released by sim_stop.
+struct sim_alloc {
+    struct sim_alloc *next;
+    max_align_t data[];
+};
+
+s64 sim_now_ns;
+int sim_verbose;
+int sim_locks_held;
+
+static struct sim_config config;
+static int started;
+static u64 random_state;
+static struct sim_ear ears[SIM_NUM_EARS];
+static struct sim_irq irqs[SIM_NUM_EARS];
+static struct hrtimer *timers;
+static struct sim_alloc *allocs;
+static struct class ears_class_storage;
+static struct cdev *cdevs[3];
+static struct device *devices[3];
+static struct platform_device pdev = { .dev = { .name = DRV_NAME } };
+static struct file files[SIM_MAX_FILES];
+static struct inode inodes[SIM_MAX_FILES];
+static int files_used[SIM_MAX_FILES];
+
+static const char *const state_names[] = {
+    [testing] = "testing",
+    [detecting] = "detecting",
+    [idle] = "idle",
+    [running] = "running",
+    [broken] = "broken",
+};
+
+// xorshift64*, so runs only depend on the seed.
+static double random_unit(void) {
+    random_state ^= random_state >> 12;
+    random_state ^= random_state << 25;
+    random_state ^= random_state >> 27;
+    return (double) ((random_state * 2685821657736338717ULL) >> 11) / (double) (1ULL << 53);
+}
+
+static struct tagtagtagears_data *driver_data(void) {
+    return started ? platform_get_drvdata(&pdev) : NULL;
+}
+
+// ========================================================================== //
+// Kernel API
+// ========================================================================== //
+
+void sim_log(int level, const struct device *dev, const char *fmt, ...) {
+    va_list args;
+    if (level > sim_verbose) {
+        return;
+    }
+    fprintf(stderr, "[%5lld.%06lld] %s: ", (long long) (sim_now_ns / NSEC_PER_SEC),
+        (long long) (sim_now_ns % NSEC_PER_SEC / NSEC_PER_USEC), dev ? dev->name : "(null)");
+    va_start(args, fmt);
+    vfprintf(stderr, fmt, args);
+    va_end(args);
+    fputc('\n', stderr);
+}
+
+void *devm_kzalloc(struct device *dev, size_t size, int gfp) {
+    struct sim_alloc *alloc = calloc(1, sizeof(*alloc) + size);
+    if (!alloc) {
+        return NULL;
+    }
+    alloc->next = allocs;
+    allocs = alloc;
+    return alloc->data;
+}
+
+void *devm_kcalloc(struct device *dev, size_t n, size_t size, int gfp) {
+    return devm_kzalloc(dev, n * size, gfp);
+}
+
+bool device_property_present(struct device *dev, const char *name) {
+    if (strcmp(name, "pwms") == 0 || strcmp(name, "pwm-names") == 0) {
+        return config.pwm;
+    }
+    return device_property_read_bool(dev, name);
+}
+
+bool device_property_read_bool(struct device *dev, const char *name) {
+    return strcmp(name, "fast-start") == 0 && config.fast_start;
+}
+
+static void free_allocs(void) {
+    while (allocs) {
+        struct sim_alloc *next = allocs->next;
+        free(allocs);
+        allocs = next;
+    }
+}
+
+struct class *sim_class_create(const char *name) {
+    ears_class_storage.name = name;
+    return &ears_class_storage;
+}
+
+void class_destroy(struct class *cls) {
+}
+
+static struct device *create_device(dev_t devt, void *drvdata, const struct attribute_group **groups, const char *fmt, va_list args) {
+    unsigned int minor = MINOR(devt);
+    struct device *device;
+    if (minor >= ARRAY_SIZE(devices) || devices[minor]) {
+        return ERR_PTR(-EEXIST);
+    }
+    device = devm_kzalloc(NULL, sizeof(*device), GFP_KERNEL);
+    if (!device) {
+        return ERR_PTR(-ENOMEM);
+    }
+    vsnprintf(device->name, sizeof(device->name), fmt, args);
+    device->driver_data = drvdata;
+    device->devt = devt;
+    device->groups = groups;
+    devices[minor] = device;
+    return device;
+}
+
+struct device *device_create(struct class *cls, struct device *parent, dev_t devt, void *drvdata, const char *fmt, ...) {
+    struct device *device;
+    va_list args;
+    va_start(args, fmt);
+    device = create_device(devt, drvdata, NULL, fmt, args);
+    va_end(args);
+    return device;
+}
+
+struct device *device_create_with_groups(struct class *cls, struct device *parent, dev_t devt, void *drvdata,
+    const struct attribute_group **groups, const char *fmt, ...) {
+    struct device *device;
+    va_list args;
+    va_start(args, fmt);
+    device = create_device(devt, drvdata, groups, fmt, args);
+    va_end(args);
+    return device;
+}
+
+void device_destroy(struct class *cls, dev_t devt) {
+    if (MINOR(devt) < ARRAY_SIZE(devices)) {
+        devices[MINOR(devt)] = NULL;
+    }
+}
+
+int alloc_chrdev_region(dev_t *dev, unsigned int baseminor, unsigned int count, const char *name) {
+    *dev = MKDEV(SIM_MAJOR, baseminor);
+    return 0;
+}
+
+void unregister_chrdev_region(dev_t from, unsigned int count) {
+}
+
+void cdev_init(struct cdev *cdev, const struct file_operations *fops) {
+    memset(cdev, 0, sizeof(*cdev));
+    cdev->ops = fops;
+}
+
+int cdev_add(struct cdev *cdev, dev_t dev, unsigned int count) {
+    if (MINOR(dev) >= ARRAY_SIZE(cdevs)) {
+        return -EINVAL;
+    }
+    cdev->dev = dev;
+    cdevs[MINOR(dev)] = cdev;
+    return 0;
+}
+
+void cdev_del(struct cdev *cdev) {
+    if (MINOR(cdev->dev) < ARRAY_SIZE(cdevs) && cdevs[MINOR(cdev->dev)] == cdev) {
+        cdevs[MINOR(cdev->dev)] = NULL;
+    }
+}
+
+// Timers are kept in a list, and fired by run() earliest first.
+
+void hrtimer_init(struct hrtimer *timer, clockid_t clock_id, enum hrtimer_mode mode) {
+    struct hrtimer *it;
+    timer->function = NULL;
+    timer->expires = 0;
+    timer->queued = false;
+    for (it = timers; it; it = it->sim_next) {
+        if (it == timer) {
+            return;
+        }
+    }
+    timer->sim_next = timers;
+    timers = timer;
+}
+
+void hrtimer_start(struct hrtimer *timer, ktime_t tim, enum hrtimer_mode mode) {
+    timer->expires = mode & HRTIMER_MODE_REL ? sim_now_ns + tim : tim;
+    timer->queued = true;
+}
+
+int hrtimer_try_to_cancel(struct hrtimer *timer) {
+    int was_queued = timer->queued;
+    timer->queued = false;
+    return was_queued;
+}
+
+int hrtimer_cancel(struct hrtimer *timer) {
+    return hrtimer_try_to_cancel(timer);
+}
+
+u64 hrtimer_forward_now(struct hrtimer *timer, ktime_t interval) {
+    u64 overruns = 0;
+    if (interval <= 0) {
+        return 0;
+    }
+    while (timer->expires <= sim_now_ns) {
+        timer->expires += interval;
+        overruns++;
+    }
+    return overruns;
+}
+
+static struct hrtimer *next_timer(void) {
+    struct hrtimer *next = NULL;
+    struct hrtimer *it;
+    for (it = timers; it; it = it->sim_next) {
+        if (it->queued && (next == NULL || it->expires < next->expires)) {
+            next = it;
+        }
+    }
+    return next;
+}
+
+static void set_duty(int ix, int line, unsigned int duty) {
+    struct sim_ear *ear = &ears[ix];
+    if (!ear->duty[0] && !ear->duty[1] && duty) {
+        ear->stats.motor_starts++;
+    }
+    ear->duty[line] = duty;
+}
+
+struct gpio_desc *devm_gpiod_get(struct device *dev, const char *con_id, enum gpiod_flags flags) {
+    if (strcmp(con_id, "left-encoder") == 0) {
+        return &ears[0].encoder_gpio;
+    }
+    if (strcmp(con_id, "right-encoder") == 0) {
+        return &ears[1].encoder_gpio;
+    }
+    return ERR_PTR(-ENOENT);
+}
+
+struct gpio_descs *devm_gpiod_get_array(struct device *dev, const char *con_id, enum gpiod_flags flags) {
+    if (strcmp(con_id, "left-motor") == 0) {
+        return &ears[0].motor_gpios;
+    }
+    if (strcmp(con_id, "right-motor") == 0) {
+        return &ears[1].motor_gpios;
+    }
+    return ERR_PTR(-ENOENT);
+}
+
+int gpiod_get_value(const struct gpio_desc *desc) {
+    if (desc->line == 2) {
+        return ears[desc->ear].high;
+    }
+    return ears[desc->ear].duty[desc->line] > 0;
+}
+
+void gpiod_set_value(struct gpio_desc *desc, int value) {
+    if (desc->line < 2) {
+        set_duty(desc->ear, desc->line, value ? 100 : 0);
+    }
+}
+
+int gpiod_set_array_value(unsigned int array_size, struct gpio_desc **desc_array,
+    struct gpio_array *array_info, unsigned long *value_bitmap) {
+    unsigned int ix;
+    for (ix = 0; ix < array_size; ix++) {
+        gpiod_set_value(desc_array[ix], (*value_bitmap & BIT(ix)) != 0);
+    }
+    return 0;
+}
+
+int gpiod_to_irq(const struct gpio_desc *desc) {
+    return SIM_IRQ_BASE + desc->ear;
+}
+
+// Without pwm-names, the kernel fails with -EINVAL.
+struct pwm_device *devm_pwm_get(struct device *dev, const char *con_id) {
+    static const char *const names[SIM_NUM_EARS][2] = {
+        { "left-forward", "left-backward" },
+        { "right-forward", "right-backward" },
+    };
+    int ix;
+    if (!config.pwm) {
+        return ERR_PTR(-EINVAL);
+    }
+    for (ix = 0; ix < 2 * SIM_NUM_EARS; ix++) {
+        if (strcmp(con_id, names[ix >> 1][ix & 1]) == 0) {
+            return &ears[ix >> 1].motor_pwms[ix & 1];
+        }
+    }
+    return ERR_PTR(-ENODATA);
+}
+
+void pwm_init_state(const struct pwm_device *pwm, struct pwm_state *state) {
+    state->period = SIM_PWM_PERIOD_NS;
+    state->duty_cycle = 0;
+    state->enabled = false;
+}
+
+int pwm_set_relative_duty_cycle(struct pwm_state *state, unsigned int duty_cycle, unsigned int scale) {
+    if (!scale || duty_cycle > scale) {
+        return -EINVAL;
+    }
+    state->duty_cycle = state->period * duty_cycle / scale;
+    return 0;
+}
+
+int pwm_apply_state(struct pwm_device *pwm, const struct pwm_state *state) {
+    set_duty(pwm->ear, pwm->line, state->enabled ? state->duty_cycle * 100 / state->period : 0);
+    return 0;
+}
+
+static struct sim_irq *get_irq(unsigned int irq) {
+    if (irq < SIM_IRQ_BASE || irq >= SIM_IRQ_BASE + SIM_NUM_EARS) {
+        return NULL;
+    }
+    return &irqs[irq - SIM_IRQ_BASE];
+}
+
+int devm_request_threaded_irq(struct device *dev, unsigned int irq, irq_handler_t handler, irq_handler_t thread_fn,
+    unsigned long irqflags, const char *devname, void *dev_id) {
+    struct sim_irq *sim_irq = get_irq(irq);
+    if (sim_irq == NULL || !(irqflags & IRQF_TRIGGER_FALLING)) {
+        return -EINVAL;
+    }
+    if (sim_irq->handler || sim_irq->thread_fn) {
+        return -EBUSY;
+    }
+    sim_irq->handler = handler;
+    sim_irq->thread_fn = thread_fn;
+    sim_irq->dev_id = dev_id;
+    return 0;
+}
+
+static void run_irq_thread(struct sim_irq *sim_irq) {
+    sim_irq->thread_pending = 0;
+    sim_irq->thread_fn(sim_irq - irqs + SIM_IRQ_BASE, sim_irq->dev_id);
+}
+
+// As in the kernel, a pending threaded handler completes first.
+void devm_free_irq(struct device *dev, unsigned int irq, void *dev_id) {
+    struct sim_irq *sim_irq = get_irq(irq);
+    if (sim_irq && sim_irq->dev_id == dev_id) {
+        if (sim_irq->thread_pending) {
+            run_irq_thread(sim_irq);
+        }
+        memset(sim_irq, 0, sizeof(*sim_irq));
+    }
+}
+
+// ========================================================================== //
+// Physical model
+// ========================================================================== //
+
+// Hole p is at slot p up to 13, then the gap spans 3 slots.
+double sim_hole_angle(int position) {
+    position = ((position % SIM_NUM_HOLES) + SIM_NUM_HOLES) % SIM_NUM_HOLES;
+    return position <= NUM_HOLES - 1 - EARS_OFFZERO ? position : position + SIM_NUM_SLOTS - SIM_NUM_HOLES;
+}
+
+static int slot_hole(int slot) {
+    if (slot <= NUM_HOLES - 1 - EARS_OFFZERO) {
+        return slot;
+    }
+    if (slot >= SIM_NUM_SLOTS - EARS_OFFZERO) {
+        return slot - (SIM_NUM_SLOTS - SIM_NUM_HOLES);
+    }
+    return -1;
+}
+
+// Hole under the encoder, or -1 if it is high.
+static int ear_hole(const struct sim_ear *ear) {
+    double nearest = floor(ear->angle + 0.5);
+    int slot = (int) nearest % SIM_NUM_SLOTS;
+    int hole = slot_hole(slot);
+    double offset = ear->angle - nearest;
+    if (hole == -1 || offset <= -config.hole_width / 2 + ear->edge_offsets[slot][0]
+        || offset >= config.hole_width / 2 + ear->edge_offsets[slot][1]) {
+        return -1;
+    }
+    return hole;
+}
+
+static void falling_edge(int ix) {
+    struct sim_irq *sim_irq = &irqs[ix];
+    ears[ix].stats.edges++;
+    if (sim_irq->handler == NULL) {
+        return;
+    }
+    if (sim_irq->handler(SIM_IRQ_BASE + ix, sim_irq->dev_id) != IRQ_WAKE_THREAD) {
+        return;
+    }
+    if (!sim_irq->thread_pending) {
+        sim_irq->thread_pending = 1;
+        sim_irq->thread_due = sim_now_ns + config.irq_latency_ns;
+    }
+}
+
+static void step_ear(int ix, s64 dt_ns) {
+    struct sim_ear *ear = &ears[ix];
+    double dt = dt_ns * 1e-9;
+    unsigned int forward = ear->duty[0];
+    unsigned int backward = ear->duty[1];
+    int high;
+
+    if (forward || backward) {
+        ear->stats.motors_on_ns += dt_ns;
+    }
+    if (ear->turning) {
+        ear->speed = ear->turn_speed;
+    } else if (ear->held) {
+        ear->speed = 0;
+    } else if (forward && backward) {
+        ear->speed -= ear->speed * fmin(1.0, dt / config.brake_tau);
+    } else if (forward || backward) {
+        double target;
+        if (sim_now_ns >= ear->noise_until) {
+            ear->noise = 1.0 + config.speed_jitter * (2.0 * random_unit() - 1.0);
+            ear->noise_until = sim_now_ns + SIM_NOISE_PERIOD_NS;
+        }
+        target = ((double) forward - (double) backward) / 100.0 * config.speed[ix] * ear->noise * SIM_NUM_SLOTS / 4.0;
+        ear->speed += (target - ear->speed) * fmin(1.0, dt / config.motor_tau);
+    } else {
+        ear->speed -= ear->speed * fmin(1.0, dt / config.coast_tau);
+        if (fabs(ear->speed) < SIM_STOP_SPEED) {
+            ear->speed = 0;
+        }
+    }
+    ear->angle = fmod(ear->angle + ear->speed * dt + SIM_NUM_SLOTS, SIM_NUM_SLOTS);
+    high = ear_hole(ear) == -1;
+    if (ear->high && !high) {
+        ear->high = high;
+        falling_edge(ix);
+    }
+    ear->high = high;
+}
+
+// Run threaded handlers and timers that are due.
+static void run_due(void) {
+    int progress;
+    do {
+        struct hrtimer *timer = next_timer();
+        int ix;
+        progress = 0;
+        for (ix = 0; ix < SIM_NUM_EARS; ix++) {
+            if (irqs[ix].thread_pending && irqs[ix].thread_due <= sim_now_ns) {
+                run_irq_thread(&irqs[ix]);
+                progress = 1;
+            }
+        }
+        if (timer && timer->expires <= sim_now_ns) {
+            timer->queued = false;
+            if (timer->function(timer) == HRTIMER_RESTART) {
+                timer->queued = true;
+            }
+            progress = 1;
+        }
+    } while (progress);
+}
+
+static void run(s64 until) {
+    while (sim_now_ns < until) {
+        struct hrtimer *timer = next_timer();
+        s64 next = min(sim_now_ns + config.step_ns, until);
+        int ix;
+        if (timer && timer->expires < next) {
+            next = max(timer->expires, sim_now_ns);
+        }
+        for (ix = 0; ix < SIM_NUM_EARS; ix++) {
+            if (irqs[ix].thread_pending && irqs[ix].thread_due < next) {
+                next = max(irqs[ix].thread_due, sim_now_ns);
+            }
+        }
+        if (next > sim_now_ns) {
+            s64 dt_ns = next - sim_now_ns;
+            sim_now_ns = next;
+            for (ix = 0; ix < SIM_NUM_EARS; ix++) {
+                step_ear(ix, dt_ns);
+            }
+        }
+        run_due();
+    }
+}
+
+int sim_wait_step(s64 start, s64 deadline) {
+    s64 until = sim_now_ns + config.step_ns;
+    if (sim_locks_held) {
+        fprintf(stderr, "sim: waiting with a lock held\n");
+        abort();
+    }
+    if (deadline == 0 && sim_now_ns - start >= SIM_WAIT_LIMIT_NS) {
+        return 1;
+    }
+    if (deadline && until > deadline) {
+        until = deadline;
+    }
+    run(until);
+    return 0;
+}
+
+// ========================================================================== //
+// Simulator interface
+// ========================================================================== //
+
+void sim_default_config(struct sim_config *cfg) {
+    int ix;
+    memset(cfg, 0, sizeof(*cfg));
+    cfg->seed = 1;
+    for (ix = 0; ix < SIM_NUM_EARS; ix++) {
+        cfg->angle[ix] = sim_hole_angle(0);
+        cfg->speed[ix] = 1.0;
+    }
+    cfg->speed_jitter = 0.03;
+    cfg->edge_jitter = 0.03;
+    cfg->hole_width = 0.35;
+    cfg->motor_tau = 0.03;
+    cfg->coast_tau = 0.06;
+    cfg->brake_tau = 0.01;
+    cfg->step_ns = 50 * NSEC_PER_USEC;
+    cfg->irq_latency_ns = 50 * NSEC_PER_USEC;
+}
+
+int sim_start(const struct sim_config *cfg) {
+    int err;
+    int ix;
+    if (started) {
+        return -EBUSY;
+    }
+    config = *cfg;
+    random_state = config.seed ? config.seed : 1;
+    sim_now_ns = NSEC_PER_SEC;      // 0 means "no time" for the driver
+    memset(ears, 0, sizeof(ears));
+    memset(irqs, 0, sizeof(irqs));
+    for (ix = 0; ix < SIM_NUM_EARS; ix++) {
+        struct sim_ear *ear = &ears[ix];
+        int slot;
+        ear->angle = fmod(fmod(config.angle[ix], SIM_NUM_SLOTS) + SIM_NUM_SLOTS, SIM_NUM_SLOTS);
+        for (slot = 0; slot < SIM_NUM_SLOTS; slot++) {
+            ear->edge_offsets[slot][0] = config.edge_jitter * (2.0 * random_unit() - 1.0);
+            ear->edge_offsets[slot][1] = config.edge_jitter * (2.0 * random_unit() - 1.0);
+        }
+        ear->noise = 1.0;
+        ear->high = ear_hole(ear) == -1;
+        ear->encoder_gpio = (struct gpio_desc) { .ear = ix, .line = 2 };
+        ear->motor_gpio[0] = (struct gpio_desc) { .ear = ix, .line = 0 };
+        ear->motor_gpio[1] = (struct gpio_desc) { .ear = ix, .line = 1 };
+        ear->motor_gpios.ndescs = 2;
+        ear->motor_gpios.desc[0] = &ear->motor_gpio[0];
+        ear->motor_gpios.desc[1] = &ear->motor_gpio[1];
+        ear->motor_pwms[0] = (struct pwm_device) { .ear = ix, .line = 0 };
+        ear->motor_pwms[1] = (struct pwm_device) { .ear = ix, .line = 1 };
+    }
+    memset(&pdev.dev.driver_data, 0, sizeof(pdev.dev.driver_data));
+    started = 1;
+    err = sim_platform_driver->probe(&pdev);
+    if (err) {
+        started = 0;
+        timers = NULL;
+        free_allocs();
+    }
+    return err;
+}
+
+void sim_stop(int shutdown) {
+    int fd;
+    if (!started) {
+        return;
+    }
+    for (fd = 0; fd < SIM_MAX_FILES; fd++) {
+        if (files_used[fd]) {
+            sim_close(fd);
+        }
+    }
+    if (shutdown) {
+        sim_platform_driver->shutdown(&pdev);
+    }
+    sim_platform_driver->remove(&pdev);
+    started = 0;
+    timers = NULL;
+    memset(irqs, 0, sizeof(irqs));
+    memset(cdevs, 0, sizeof(cdevs));
+    memset(devices, 0, sizeof(devices));
+    free_allocs();
+}
+
+int64_t sim_time_ns(void) {
+    return sim_now_ns;
+}
+
+void sim_run_for(int64_t ns) {
+    run(sim_now_ns + ns);
+}
+
+static int ears_settled(void) {
+    struct tagtagtagears_data *priv = driver_data();
+    int ix;
+    for (ix = 0; ix < SIM_NUM_EARS; ix++) {
+        if (!is_drained(&priv->ear[ix]) || ears[ix].speed != 0 || ears[ix].duty[0] || ears[ix].duty[1]) {
+            return 0;
+        }
+    }
+    return 1;
+}
+
+int sim_run_until_idle(int64_t timeout_ns) {
+    s64 deadline = sim_now_ns + timeout_ns;
+    if (!started) {
+        return -ENODEV;
+    }
+    while (!ears_settled()) {
+        if (sim_now_ns >= deadline) {
+            return -ETIMEDOUT;
+        }
+        run(min(sim_now_ns + config.step_ns, deadline));
+    }
+    return 0;
+}
+
+int sim_open(int minor, int flags) {
+    int err;
+    int fd;
+    if (minor < 0 || minor >= (int) ARRAY_SIZE(cdevs) || cdevs[minor] == NULL) {
+        return -ENODEV;
+    }
+    for (fd = 0; fd < SIM_MAX_FILES && files_used[fd]; fd++) {
+    }
+    if (fd == SIM_MAX_FILES) {
+        return -EMFILE;
+    }
+    inodes[fd].i_cdev = cdevs[minor];
+    memset(&files[fd], 0, sizeof(files[fd]));
+    files[fd].f_flags = flags;
+    err = cdevs[minor]->ops->open(&inodes[fd], &files[fd]);
+    if (err) {
+        return err;
+    }
+    files_used[fd] = 1;
+    return fd;
+}
+
+static const struct file_operations *file_ops(int fd) {
+    if (fd < 0 || fd >= SIM_MAX_FILES || !files_used[fd]) {
+        return NULL;
+    }
+    return inodes[fd].i_cdev->ops;
+}
+
+ssize_t sim_write(int fd, const void *buffer, size_t len) {
+    const struct file_operations *ops = file_ops(fd);
+    if (ops == NULL || ops->write == NULL) {
+        return -EBADF;
+    }
+    return ops->write(&files[fd], buffer, len, &files[fd].f_pos);
+}
+
+ssize_t sim_read(int fd, void *buffer, size_t len) {
+    const struct file_operations *ops = file_ops(fd);
+    if (ops == NULL || ops->read == NULL) {
+        return -EBADF;
+    }
+    return ops->read(&files[fd], buffer, len, &files[fd].f_pos);
+}
+
+unsigned int sim_poll(int fd) {
+    const struct file_operations *ops = file_ops(fd);
+    if (ops == NULL || ops->poll == NULL) {
+        return POLLERR;
+    }
+    return ops->poll(&files[fd], NULL);
+}
+
+void sim_close(int fd) {
+    const struct file_operations *ops = file_ops(fd);
+    if (ops) {
+        ops->release(&inodes[fd], &files[fd]);
+        files_used[fd] = 0;
+    }
+}
+
+static struct device_attribute *find_attr(int minor, const char *name, struct device **device) {
+    const struct attribute_group **group;
+    if (minor < 0 || minor >= (int) ARRAY_SIZE(devices) || devices[minor] == NULL || devices[minor]->groups == NULL) {
+        return NULL;
+    }
+    *device = devices[minor];
+    for (group = devices[minor]->groups; *group; group++) {
+        struct attribute **attr;
+        for (attr = (*group)->attrs; *attr; attr++) {
+            if (strcmp((*attr)->name, name) == 0) {
+                return container_of(*attr, struct device_attribute, attr);
+            }
+        }
+    }
+    return NULL;
+}
+
+ssize_t sim_attr_read(int minor, const char *name, char *buffer, size_t size) {
+    char page[PAGE_SIZE] = "";
+    struct device *device;
+    struct device_attribute *attr = find_attr(minor, name, &device);
+    ssize_t result;
+    if (attr == NULL) {
+        return -ENOENT;
+    }
+    if (attr->show == NULL) {
+        return -EACCES;
+    }
+    result = attr->show(device, attr, page);
+    if (result >= 0 && size > 0) {
+        snprintf(buffer, size, "%.*s", (int) result, page);
+    }
+    return result;
+}
+
+ssize_t sim_attr_write(int minor, const char *name, const char *value) {
+    struct device *device;
+    struct device_attribute *attr = find_attr(minor, name, &device);
+    if (attr == NULL) {
+        return -ENOENT;
+    }
+    if (attr->store == NULL) {
+        return -EACCES;
+    }
+    return attr->store(device, attr, value, strlen(value));
+}
+
+extern const struct sim_param __start_sim_params[];
+extern const struct sim_param __stop_sim_params[];
+
+static const struct sim_param *find_param(const char *name) {
+    const struct sim_param *param;
+    for (param = __start_sim_params; param < __stop_sim_params; param++) {
+        if (strcmp(param->name, name) == 0) {
+            return param;
+        }
+    }
+    return NULL;
+}
+
+int sim_param_set(const char *name, long value) {
+    const struct sim_param *param = find_param(name);
+    if (param == NULL) {
+        return -ENOENT;
+    }
+    if (started && !(param->perm & 0200)) {
+        return -EPERM;
+    }
+    switch (param->type) {
+        case SIM_PARAM_uint:
+            *(unsigned int *) param->value = value;
+            break;
+        case SIM_PARAM_int:
+            *(int *) param->value = value;
+            break;
+        case SIM_PARAM_bool:
+            *(bool *) param->value = value != 0;
+            break;
+    }
+    return 0;
+}
+
+int sim_param_get(const char *name, long *value) {
+    const struct sim_param *param = find_param(name);
+    if (param == NULL) {
+        return -ENOENT;
+    }
+    switch (param->type) {
+        case SIM_PARAM_uint:
+            *value = *(unsigned int *) param->value;
+            break;
+        case SIM_PARAM_int:
+            *value = *(int *) param->value;
+            break;
+        case SIM_PARAM_bool:
+            *value = *(bool *) param->value;
+            break;
+    }
+    return 0;
+}
+
+void sim_hold(int ear, int held) {
+    ears[ear].held = held;
+}
+
+void sim_turn(int ear, double speed) {
+    ears[ear].turning = speed != 0;
+    ears[ear].turn_speed = speed;
+}
+
+double sim_angle(int ear) {
+    return ears[ear].angle;
+}
+
+int sim_hole(int ear) {
+    return ear_hole(&ears[ear]);
+}
+
+const char *sim_state(int ear) {
+    struct tagtagtagears_data *priv = driver_data();
+    return priv ? state_names[priv->ear[ear].state_e] : "none";
+}
+
+int sim_position(int ear) {
+    struct tagtagtagears_data *priv = driver_data();
+    if (priv == NULL || priv->ear[ear].state_e != idle) {
+        return -1;
+    }
+    return priv->ear[ear].state.idle.position;
+}
+
+void sim_stats(int ear, struct sim_ear_stats *stats) {
+    *stats = ears[ear].stats;
+}
+
+int sim_corrections(int ear) {
+    struct tagtagtagears_data *priv = driver_data();
+    return priv ? priv->ear[ear].corrections : 0;
+}
+
+// ========================================================================== //
+// KUnit
+// ========================================================================== //
+
+extern struct kunit_suite *const __start_sim_kunit[];
+extern struct kunit_suite *const __stop_sim_kunit[];
+
+void *kunit_kzalloc(struct kunit *test, size_t size, int gfp) {
+    return devm_kzalloc(NULL, size, gfp);
+}
+
+void sim_kunit_fail(struct kunit *test, const char *file, int line, const char *fmt, ...) {
+    va_list args;
+    printf("        # %s: EXPECTATION FAILED at %s:%d\n        ", test->name, file, line);
+    va_start(args, fmt);
+    vprintf(fmt, args);
+    va_end(args);
+    printf("\n");
+    test->failed = 1;
+}
+
+void sim_kunit_abort(struct kunit *test) {
+    longjmp(test->abort, 1);
+}
+
+// Run a test case with its own timers and allocations.
+static int run_kunit_case(struct kunit_suite *suite, struct kunit_case *test_case, int number) {
+    static struct kunit test;
+    memset(&test, 0, sizeof(test));
+    test.name = test_case->name;
+    sim_now_ns = NSEC_PER_SEC;
+    if (suite->init && suite->init(&test)) {
+        printf("        # %s: initialization failed\n", test.name);
+        test.failed = 1;
+    } else {
+        if (setjmp(test.abort) == 0) {
+            test_case->run_case(&test);
+        }
+        if (suite->exit) {
+            suite->exit(&test);
+        }
+    }
+    timers = NULL;
+    free_allocs();
+    printf("    %s %d %s\n", test.failed ? "not ok" : "ok", number, test.name);
+    return test.failed;
+}
+
+int sim_kunit_run(void) {
+    struct kunit_suite *const *suite;
+    int failures = 0;
+    int number = 0;
+    if (started) {
+        return -EBUSY;
+    }
+    printf("KTAP version 1\n1..%d\n", (int) (__stop_sim_kunit - __start_sim_kunit));
+    for (suite = __start_sim_kunit; suite < __stop_sim_kunit; suite++) {
+        struct kunit_case *test_case;
+        int suite_failures = 0;
+        int count = 0;
+        for (test_case = (*suite)->test_cases; test_case->run_case; test_case++) {
+            count++;
+        }
+        printf("    KTAP version 1\n    # Subtest: %s\n    1..%d\n", (*suite)->name, count);
+        count = 0;
+        for (test_case = (*suite)->test_cases; test_case->run_case; test_case++) {
+            suite_failures += run_kunit_case(*suite, test_case, ++count);
+        }
+        printf("%s %d %s\n", suite_failures ? "not ok" : "ok", ++number, (*suite)->name);
+        failures += suite_failures;
+    }
+    return failures;
+}
@@ -0,0 +1,99 @@
+// Simulated ears running the tagtagtag-ears driver in userspace.
+//
+// The driver is compiled unmodified against the kernel API of
+// include/sim-kernel.h, and drives two simulated ears: a DC motor with
+// inertia turning a wheel with 17 holes and a 4-hole wide gap, read by an
+// encoder. Time is virtual: it only advances while the simulator runs, so
+// runs are deterministic for a given seed and much faster than real time.
+//
+// Angles are in slots, the distance between two holes: a turn is 20 slots
+// and takes 4 seconds at full speed. Hole p is at sim_hole_angle(p).
+
+#ifndef SIM_H
+#define SIM_H
+
+#include <stdint.h>
+#include <sys/types.h>
+
+#define SIM_NUM_EARS 2
+#define SIM_NUM_HOLES 17
+#define SIM_NUM_SLOTS 20
+#define SIM_COMBINED_MINOR 2
+
+struct sim_config {
+    unsigned int seed;              // seed of random jitter
+    int pwm;                        // motors are driven by PWMs, not GPIOs
+    int fast_start;                 // device tree has the fast-start property
+    double angle[SIM_NUM_EARS];     // initial angle of each ear, in slots
+    double speed[SIM_NUM_EARS];     // speed factor of each motor (1.0: 0.2 s per slot)
+    double speed_jitter;            // relative speed noise
+    double edge_jitter;             // offset of hole edges, in slots
+    double hole_width;              // part of a slot where the encoder is low
+    double motor_tau;               // time constant of motor acceleration, in seconds
+    double coast_tau;               // time constant of coasting, in seconds
+    double brake_tau;               // time constant of braking, in seconds
+    int64_t step_ns;                // integration step
+    int64_t irq_latency_ns;         // delay before the threaded handler runs
+};
+
+struct sim_ear_stats {
+    unsigned int edges;             // falling edges of the encoder
+    unsigned int motor_starts;      // times motors were switched on
+    int64_t motors_on_ns;           // time motors were on (or braking)
+};
+
+// Driver messages up to this level are printed on stderr: 0 errors,
+// 1 warnings, 2 info, 3 debug.
+extern int sim_verbose;
+
+void sim_default_config(struct sim_config *config);
+double sim_hole_angle(int position);
+
+// Probe the driver. Returns the probe result.
+int sim_start(const struct sim_config *config);
+// Shut down (if shutdown is set) and remove the driver.
+void sim_stop(int shutdown);
+
+int64_t sim_time_ns(void);
+void sim_run_for(int64_t ns);
+// Run until both ears are idle (or broken) with no queued command, and stopped.
+// Returns 0, or -ETIMEDOUT.
+int sim_run_until_idle(int64_t timeout_ns);
+
+// Files of /dev/ear0, /dev/ear1 and /dev/ears (SIM_COMBINED_MINOR).
+// Blocking calls run the simulator while they wait.
+int sim_open(int minor, int flags);
+ssize_t sim_write(int fd, const void *buffer, size_t len);
+ssize_t sim_read(int fd, void *buffer, size_t len);
+unsigned int sim_poll(int fd);
+void sim_close(int fd);
+
+// Sysfs attributes of /sys/class/ear/ear*.
+ssize_t sim_attr_read(int minor, const char *name, char *buffer, size_t size);
+ssize_t sim_attr_write(int minor, const char *name, const char *value);
+
+// Module parameters. Read-only parameters can only be set before
+// sim_start. Return 0, -ENOENT or -EPERM.
+int sim_param_set(const char *name, long value);
+int sim_param_get(const char *name, long *value);
+
+// User interactions: hold an ear still, or turn it by hand at speed slots
+// per second (0 to release it).
+void sim_hold(int ear, int held);
+void sim_turn(int ear, double speed);
+
+double sim_angle(int ear);
+// Hole the ear is on (encoder is low), or -1.
+int sim_hole(int ear);
+// Driver state and position, -1 if unknown or not idle.
+const char *sim_state(int ear);
+int sim_position(int ear);
+void sim_stats(int ear, struct sim_ear_stats *stats);
+// Correction steps of the last command.
+int sim_corrections(int ear);
+
+// Run the KUnit suite of tagtagtag-ears-test.c, printing KTAP results, while
+// the driver is not loaded. Returns the number of failed test cases.
+int sim_kunit_run(void);
+
+#endif
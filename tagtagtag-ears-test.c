@@ -0,0 +1,521 @@
+// SPDX-License-Identifier: GPL-2.0
+//
+// KUnit tests of tagtagtag-ears position helpers and of the testing,
+// detecting and running state machines, fed with synthetic edge timestamps.
+//
+// This file is included at the end of tagtagtag-ears.c when
+// CONFIG_TAGTAGTAG_EARS_KUNIT_TEST is enabled, so static functions can be
+// tested. See Test.md.
+
+#include <kunit/test.h>
+
+#define TEST_HOLE_US 200000         // interval between two holes at full speed
+#define TEST_GAP_US 800000          // interval across the gap
+#define TEST_START_MS 1000
+
+// Regular intervals of a real ear are within +/- 8% of the average.
+static const long test_noise_us[NUM_HOLES] = {
+    -4000, 12000, -15000, 7000, 0, -9000, 16000, 3000, -12000,
+    9000, -6000, 14000, -2000, 5000, -16000, 11000, -7000,
+};
+
+// ========================================================================== //
+// Position helpers
+// ========================================================================== //
+
+static void position_add_test(struct kunit *test) {
+    KUNIT_EXPECT_EQ(test, position_add(0, 1), 1);
+    KUNIT_EXPECT_EQ(test, position_add(16, 1), 0);
+    KUNIT_EXPECT_EQ(test, position_add(0, -1), 16);
+    KUNIT_EXPECT_EQ(test, position_add(5, 16), 4);
+    KUNIT_EXPECT_EQ(test, position_add(5, -16), 6);
+    KUNIT_EXPECT_EQ(test, position_add(3, 0), 3);
+}
+
+static void gap_end_position_test(struct kunit *test) {
+    // The gap is between 13 and 14.
+    KUNIT_EXPECT_EQ(test, gap_end_position(1), 14);
+    KUNIT_EXPECT_EQ(test, gap_end_position(-1), 13);
+}
+
+static void detected_previous_position_test(struct kunit *test) {
+    int holes_count;
+    // Going forward, the gap is crossed when reaching 14.
+    for (holes_count = 1; holes_count <= NUM_HOLES; holes_count++) {
+        int position = detected_previous_position(holes_count);
+        KUNIT_EXPECT_LT(test, position, NUM_HOLES);
+        KUNIT_EXPECT_GE(test, position, 0);
+        KUNIT_EXPECT_EQ(test, position_add(position, holes_count), gap_end_position(1));
+    }
+    KUNIT_EXPECT_EQ(test, detected_previous_position(1), 13);
+    KUNIT_EXPECT_EQ(test, detected_previous_position(14), 0);
+    KUNIT_EXPECT_EQ(test, detected_previous_position(17), 14);
+}
+
+static void minimize_delta_test(struct kunit *test) {
+    int delta;
+    for (delta = -9; delta <= 9; delta++) {
+        KUNIT_EXPECT_EQ(test, minimize_delta(delta), delta);
+    }
+    KUNIT_EXPECT_EQ(test, minimize_delta(10), -7);
+    KUNIT_EXPECT_EQ(test, minimize_delta(-10), 7);
+    KUNIT_EXPECT_EQ(test, minimize_delta(16), -1);
+    KUNIT_EXPECT_EQ(test, minimize_delta(-16), 1);
+    KUNIT_EXPECT_EQ(test, minimize_delta(20), 3);
+    KUNIT_EXPECT_EQ(test, minimize_delta(-20), -3);
+}
+
+// ========================================================================== //
+// Gap detection
+// ========================================================================== //
+
+static void fill_deltas(unsigned long hole_deltas[NUM_HOLES], int gap_ix, unsigned long hole_us, unsigned long gap_us, bool noisy) {
+    int ix;
+    for (ix = 0; ix < NUM_HOLES; ix++) {
+        hole_deltas[ix] = ix == gap_ix ? gap_us : hole_us;
+        if (noisy) {
+            hole_deltas[ix] += test_noise_us[ix] * (long) hole_deltas[ix] / TEST_HOLE_US;
+        }
+    }
+}
+
+// Largest delta but the gap.
+static unsigned long max_hole_delta(const unsigned long hole_deltas[NUM_HOLES], int gap_ix) {
+    unsigned long max = 0;
+    int ix;
+    for (ix = 0; ix < NUM_HOLES; ix++) {
+        if (ix != gap_ix && hole_deltas[ix] > max) {
+            max = hole_deltas[ix];
+        }
+    }
+    return max;
+}
+
+static void find_gap_test(struct kunit *test) {
+    unsigned long hole_deltas[NUM_HOLES];
+    int gap_ix;
+    for (gap_ix = 0; gap_ix < NUM_HOLES; gap_ix++) {
+        unsigned long max, gap;
+        fill_deltas(hole_deltas, gap_ix, TEST_HOLE_US, TEST_GAP_US, false);
+        KUNIT_EXPECT_EQ(test, find_gap(hole_deltas, &max, &gap), gap_ix);
+        KUNIT_EXPECT_EQ(test, max, TEST_HOLE_US);
+        KUNIT_EXPECT_EQ(test, gap, TEST_GAP_US);
+    }
+}
+
+// The gap is the second delta when the ear started on the hole before the
+// gap's first hole (12). It used to be reported at index 0, so position was
+// off by one after the start-up test turn.
+static void find_gap_second_delta_test(struct kunit *test) {
+    unsigned long hole_deltas[NUM_HOLES];
+    unsigned long max, gap;
+    fill_deltas(hole_deltas, 1, TEST_HOLE_US, TEST_GAP_US, true);
+    KUNIT_EXPECT_EQ(test, find_gap(hole_deltas, &max, &gap), 1);
+    KUNIT_EXPECT_EQ(test, max, max_hole_delta(hole_deltas, 1));
+    KUNIT_EXPECT_EQ(test, gap, hole_deltas[1]);
+}
+
+static void find_gap_noisy_test(struct kunit *test) {
+    unsigned long hole_deltas[NUM_HOLES];
+    int gap_ix;
+    for (gap_ix = 0; gap_ix < NUM_HOLES; gap_ix++) {
+        unsigned long max, gap;
+        fill_deltas(hole_deltas, gap_ix, TEST_HOLE_US, TEST_GAP_US, true);
+        KUNIT_EXPECT_EQ(test, find_gap(hole_deltas, &max, &gap), gap_ix);
+        KUNIT_EXPECT_EQ(test, max, max_hole_delta(hole_deltas, gap_ix));
+        KUNIT_EXPECT_EQ(test, gap, hole_deltas[gap_ix]);
+    }
+}
+
+static void find_gap_slow_ear_test(struct kunit *test) {
+    unsigned long hole_deltas[NUM_HOLES];
+    unsigned long max, gap;
+    fill_deltas(hole_deltas, 9, 3 * TEST_HOLE_US, 3 * TEST_GAP_US, true);
+    KUNIT_EXPECT_EQ(test, find_gap(hole_deltas, &max, &gap), 9);
+    KUNIT_EXPECT_EQ(test, max, max_hole_delta(hole_deltas, 9));
+    KUNIT_EXPECT_EQ(test, gap, hole_deltas[9]);
+}
+
+// ========================================================================== //
+// State machines
+// ========================================================================== //
+
+// Ear with no hardware: motor values are only recorded (as if the combined
+// device applied them), and the encoder is never read.
+static int ears_test_init(struct kunit *test) {
+    struct tagtagtagear_data *priv = kunit_kzalloc(test, sizeof(*priv), GFP_KERNEL);
+    if (!priv)
+        return -ENOMEM;
+    INIT_KFIFO(priv->events);
+    INIT_KFIFO(priv->edges);
+    spin_lock_init(&priv->lock);
+    init_waitqueue_head(&priv->read_wq);
+    init_waitqueue_head(&priv->write_wq);
+    // Timers are armed by the state machine, but tests end before they expire.
+    hrtimer_init(&priv->broken_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+    priv->broken_timer.function = tagtagtagear_broken_timer_cb;
+    hrtimer_init(&priv->start_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+    priv->start_timer.function = tagtagtagear_start_timer_cb;
+    hrtimer_init(&priv->brake_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+    priv->brake_timer.function = tagtagtagear_brake_timer_cb;
+    hrtimer_init(&priv->stop_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+    priv->stop_timer.function = tagtagtagear_stop_timer_cb;
+    hrtimer_init(&priv->settle_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+    priv->settle_timer.function = tagtagtagear_settle_timer_cb;
+    hrtimer_init(&priv->retry_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+    priv->retry_timer.function = tagtagtagear_retry_timer_cb;
+    hrtimer_init(&priv->retest_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+    priv->retest_timer.function = tagtagtagear_retest_timer_cb;
+    priv->motors_deferred = 1;
+    test->priv = priv;
+    return 0;
+}
+
+static void ears_test_exit(struct kunit *test) {
+    struct tagtagtagear_data *priv = test->priv;
+    hrtimer_cancel(&priv->retest_timer);
+    hrtimer_cancel(&priv->retry_timer);
+    hrtimer_cancel(&priv->start_timer);
+    hrtimer_cancel(&priv->stop_timer);
+    hrtimer_cancel(&priv->settle_timer);
+    hrtimer_cancel(&priv->broken_timer);
+    hrtimer_cancel(&priv->brake_timer);
+}
+
+// Feed an edge to the state machine, as the threaded handler does.
+static void feed_edge(struct tagtagtagear_data *priv, ktime_t edge_time) {
+    spin_lock_bh(&priv->lock);
+    handle_edge(priv, edge_time);
+    spin_unlock_bh(&priv->lock);
+}
+
+// Interval before reaching position going forward.
+static unsigned long forward_delta_us(int position, unsigned long hole_us, unsigned long gap_us) {
+    return position == gap_end_position(1) ? gap_us : hole_us;
+}
+
+// Start-up test turn from position: the first edge is the next hole, then
+// a full turn forward and one hole backward.
+static void run_testing(struct tagtagtagear_data *priv, int position, unsigned long hole_us, unsigned long gap_us, bool noisy) {
+    ktime_t now = ms_to_ktime(TEST_START_MS);
+    unsigned long backward_us;
+    int ix;
+
+    priv->state_e = testing;
+    memset(&priv->state, 0, sizeof(priv->state));
+    feed_edge(priv, now);
+    for (ix = 0; ix < NUM_HOLES; ix++) {
+        unsigned long delta_us = forward_delta_us(position_add(position, ix + 2), hole_us, gap_us);
+        if (noisy) {
+            delta_us += test_noise_us[ix] * (long) delta_us / TEST_HOLE_US;
+        }
+        now = ktime_add_us(now, delta_us);
+        feed_edge(priv, now);
+    }
+    // Back from position + 1 to position.
+    backward_us = forward_delta_us(position_add(position, 1), hole_us, gap_us);
+    feed_edge(priv, ktime_add_us(now, backward_us));
+}
+
+static void testing_test(struct kunit *test) {
+    struct tagtagtagear_data *priv = test->priv;
+    int position;
+    for (position = 0; position < NUM_HOLES; position++) {
+        run_testing(priv, position, TEST_HOLE_US, TEST_GAP_US, true);
+        // Motors are cut on position, settle_timer then checks the ear stayed there.
+        KUNIT_EXPECT_EQ(test, priv->state_e, running);
+        KUNIT_EXPECT_TRUE(test, priv->state.running.settling);
+        KUNIT_EXPECT_EQ(test, (int) priv->state.running.position, position);
+        KUNIT_EXPECT_GT(test, priv->gap_period_us, priv->hole_period_us * 3);
+        KUNIT_EXPECT_EQ(test, priv->detect_boundary_us, (priv->hole_period_us + priv->gap_period_us) / 2);
+        KUNIT_EXPECT_EQ(test, priv->motor_values[0], 0);
+        KUNIT_EXPECT_EQ(test, priv->motor_values[1], 0);
+    }
+}
+
+static void testing_slow_ear_test(struct kunit *test) {
+    struct tagtagtagear_data *priv = test->priv;
+    run_testing(priv, 6, 3 * TEST_HOLE_US, 3 * TEST_GAP_US, true);
+    KUNIT_EXPECT_EQ(test, priv->state_e, running);
+    KUNIT_EXPECT_EQ(test, (int) priv->state.running.position, 6);
+}
+
+// A gap shorter than 1.5 regular interval is not trusted.
+static void testing_gap_not_obvious_test(struct kunit *test) {
+    struct tagtagtagear_data *priv = test->priv;
+    run_testing(priv, 6, TEST_HOLE_US, TEST_HOLE_US * 14 / 10, false);
+    KUNIT_EXPECT_EQ(test, priv->state_e, broken);
+    KUNIT_EXPECT_EQ(test, priv->motor_values[0], 0);
+    KUNIT_EXPECT_EQ(test, priv->motor_values[1], 0);
+    run_testing(priv, 6, TEST_HOLE_US, TEST_HOLE_US * 16 / 10, false);
+    KUNIT_EXPECT_EQ(test, priv->state_e, running);
+    KUNIT_EXPECT_EQ(test, (int) priv->state.running.position, 6);
+}
+
+// Going back one hole must cross the gap if and only if the forward turn
+// ended at its end.
+static void testing_incoherent_backward_test(struct kunit *test) {
+    struct tagtagtagear_data *priv = test->priv;
+    ktime_t now = ms_to_ktime(TEST_START_MS);
+    int ix;
+
+    // Start at 5: the turn ends at 6, going back to 5 is a regular hole.
+    priv->state_e = testing;
+    memset(&priv->state, 0, sizeof(priv->state));
+    feed_edge(priv, now);
+    for (ix = 0; ix < NUM_HOLES; ix++) {
+        now = ktime_add_us(now, forward_delta_us(position_add(5, ix + 2), TEST_HOLE_US, TEST_GAP_US));
+        feed_edge(priv, now);
+    }
+    feed_edge(priv, ktime_add_us(now, TEST_GAP_US));
+    KUNIT_EXPECT_EQ(test, priv->state_e, broken);
+}
+
+// Detection of position going in direction, from position, or from between
+// position and the next hole in direction, to read position (new_position
+// -1) or to reach new_position. The ear is calibrated with hole_us and
+// gap_us, and intervals are noisy if requested.
+static void run_detecting(struct tagtagtagear_data *priv, int position, bool between_holes, int direction, int new_position,
+    unsigned long hole_us, unsigned long gap_us, bool noisy) {
+    ktime_t now = ms_to_ktime(TEST_START_MS);
+    int hole = position;
+    int ix;
+
+    priv->detect_boundary_us = (hole_us + gap_us) / 2;
+    priv->hole_period_us = hole_us;
+    priv->gap_period_us = gap_us;
+    priv->state_e = detecting;
+    memset(&priv->state, 0, sizeof(priv->state));
+    priv->state.detecting.post_state = new_position == -1 ? read_position : goto_position;
+    priv->state.detecting.new_position = new_position == -1 ? 0 : new_position;
+    priv->state.detecting.direction = direction;
+    priv->motors_start_time = now;  // motors run while detecting
+    if (between_holes) {
+        // Synchronize on the next hole.
+        hole = position_add(hole, direction);
+        now = ktime_add_us(now, hole_us / 2);
+        feed_edge(priv, now);
+    } else {
+        priv->state.detecting.last_hole_time = now;
+    }
+    for (ix = 0; priv->state_e == detecting && ix < 2 * NUM_HOLES; ix++) {
+        unsigned long delta_us;
+        hole = position_add(hole, direction);
+        delta_us = hole == gap_end_position(direction) ? gap_us : hole_us;
+        if (noisy) {
+            delta_us += test_noise_us[hole] * (long) delta_us / TEST_HOLE_US;
+        }
+        now = ktime_add_us(now, delta_us);
+        feed_edge(priv, now);
+    }
+}
+
+// Once the gap is found going in direction, the ear goes to target from
+// there, or settles there.
+static void expect_detected(struct kunit *test, struct tagtagtagear_data *priv, int direction, int target) {
+    int gap_end = gap_end_position(direction);
+    int delta = minimize_delta(position_add(target, -gap_end));
+    KUNIT_EXPECT_EQ(test, priv->state_e, running);
+    if (delta == 0) {
+        KUNIT_EXPECT_TRUE(test, priv->state.running.settling);
+        KUNIT_EXPECT_EQ(test, (int) priv->state.running.position, target);
+    } else {
+        KUNIT_EXPECT_EQ(test, (int) priv->state.running.position, gap_end);
+        KUNIT_EXPECT_EQ(test, (int) priv->state.running.count, abs(delta));
+        KUNIT_EXPECT_EQ(test, (int) priv->state.running.direction, delta > 0 ? 1 : -1);
+    }
+}
+
+static void expect_read_position(struct kunit *test, struct tagtagtagear_data *priv, int detected) {
+    struct ear_event event;
+    KUNIT_ASSERT_TRUE(test, kfifo_get(&priv->events, &event));
+    KUNIT_EXPECT_EQ(test, event.type, EAR_EVENT_POSITION);
+    KUNIT_EXPECT_EQ(test, event.position, detected);
+    // The ear then goes back to the detected position.
+    expect_detected(test, priv, 1, detected);
+}
+
+static void detecting_test(struct kunit *test) {
+    struct tagtagtagear_data *priv = test->priv;
+    int ix;
+    for (ix = 0; ix < 2 * NUM_HOLES; ix++) {
+        int position = ix / 2;
+        bool between_holes = ix % 2;
+        run_detecting(priv, position, between_holes, 1, -1, TEST_HOLE_US, TEST_GAP_US, false);
+        expect_read_position(test, priv, between_holes ? position_add(position, 1) : position);
+    }
+}
+
+static void detecting_slow_noisy_test(struct kunit *test) {
+    struct tagtagtagear_data *priv = test->priv;
+    int ix;
+    for (ix = 0; ix < 2 * NUM_HOLES; ix++) {
+        int position = ix / 2;
+        bool between_holes = ix % 2;
+        int detected = between_holes ? position_add(position, 1) : position;
+        run_detecting(priv, position, between_holes, 1, -1, TEST_HOLE_US, TEST_GAP_US, true);
+        expect_read_position(test, priv, detected);
+        run_detecting(priv, position, between_holes, 1, -1, 3 * TEST_HOLE_US, 3 * TEST_GAP_US, true);
+        expect_read_position(test, priv, detected);
+    }
+}
+
+// Backward detection for a move: the gap is crossed onto its other end.
+// Between holes, the ear synchronizes on the previous hole, counted as a
+// hole crossed.
+static void detecting_backward_test(struct kunit *test) {
+    struct tagtagtagear_data *priv = test->priv;
+    int ix;
+    for (ix = 0; ix < 2 * NUM_HOLES; ix++) {
+        int position = ix / 2;
+        bool between_holes = ix % 2;
+        int target = position_add(position, -5);
+        run_detecting(priv, position, between_holes, -1, target, TEST_HOLE_US, TEST_GAP_US, true);
+        expect_detected(test, priv, -1, target);
+    }
+
+    priv->state_e = detecting;
+    memset(&priv->state, 0, sizeof(priv->state));
+    priv->state.detecting.post_state = goto_position;
+    priv->state.detecting.direction = -1;
+    feed_edge(priv, ms_to_ktime(TEST_START_MS));
+    KUNIT_EXPECT_EQ(test, priv->state_e, detecting);
+    KUNIT_EXPECT_EQ(test, (int) priv->state.detecting.holes_count, 1);
+    KUNIT_EXPECT_EQ(test, priv->state.detecting.last_hole_time, ms_to_ktime(TEST_START_MS));
+}
+
+// Only intervals at cruise speed update hole period: not the first one when
+// the ear starts from a hole.
+static void detecting_from_standstill_test(struct kunit *test) {
+    struct tagtagtagear_data *priv = test->priv;
+    ktime_t now = ms_to_ktime(TEST_START_MS);
+
+    priv->hole_period_us = TEST_HOLE_US;
+    priv->gap_period_us = TEST_GAP_US;
+    priv->detect_boundary_us = (TEST_HOLE_US + TEST_GAP_US) / 2;
+    priv->state_e = detecting;
+    memset(&priv->state, 0, sizeof(priv->state));
+    priv->state.detecting.post_state = read_position;
+    priv->state.detecting.direction = 1;
+    priv->state.detecting.last_hole_time = now;
+    priv->state.detecting.from_standstill = 1;
+    now = ktime_add_us(now, TEST_HOLE_US * 3 / 2);
+    feed_edge(priv, now);
+    KUNIT_EXPECT_EQ(test, priv->hole_period_us, TEST_HOLE_US);
+    now = ktime_add_us(now, TEST_HOLE_US + 8000);
+    feed_edge(priv, now);
+    KUNIT_EXPECT_EQ(test, priv->hole_period_us, TEST_HOLE_US + 1000);
+}
+
+// Move forward at cruise speed from hole from, believed to be position, until
+// motors are cut: an edge is fed for each hole but missed, and a spurious one
+// halfway to spurious (-1: none). Return the hole the ear stopped on.
+static int run_running(struct tagtagtagear_data *priv, int from, int position, int count, int missed, int spurious) {
+    ktime_t now = ms_to_ktime(TEST_START_MS);
+    int hole = from;
+    int ix;
+
+    priv->detect_boundary_us = (TEST_HOLE_US + TEST_GAP_US) / 2;
+    priv->hole_period_us = TEST_HOLE_US;
+    priv->gap_period_us = TEST_GAP_US;
+    priv->command_flags = 0;
+    priv->state_e = running;
+    memset(&priv->state, 0, sizeof(priv->state));
+    priv->state.running.position = position;
+    priv->state.running.count = count;
+    priv->state.running.direction = 1;
+    priv->state.running.last_hole_time = now;
+    for (ix = 0; ix < 2 * NUM_HOLES && !priv->state.running.settling; ix++) {
+        unsigned long delta_us;
+        hole = position_add(hole, 1);
+        delta_us = forward_delta_us(hole, TEST_HOLE_US, TEST_GAP_US);
+        if (hole == spurious) {
+            feed_edge(priv, ktime_add_us(now, delta_us / 2));
+        }
+        now = ktime_add_us(now, delta_us);
+        if (hole != missed) {
+            feed_edge(priv, now);
+        }
+    }
+    return hole;
+}
+
+// A spurious edge is found when the gap is one hole late: count is fixed
+// there. If the move ends first, position is not trusted.
+static void running_spurious_edge_test(struct kunit *test) {
+    struct tagtagtagear_data *priv = test->priv;
+    int gap_end = gap_end_position(1);
+    int hole;
+
+    hole = run_running(priv, position_add(gap_end, -6), position_add(gap_end, -6), 10, -1, position_add(gap_end, -3));
+    KUNIT_EXPECT_EQ(test, hole, position_add(gap_end, 4));
+    KUNIT_EXPECT_TRUE(test, priv->state.running.settling);
+    KUNIT_EXPECT_EQ(test, (int) priv->state.running.position, hole);
+    KUNIT_EXPECT_FALSE(test, priv->state.running.unsure);
+    KUNIT_EXPECT_TRUE(test, priv->command_flags & EAR_DONE_RESYNC);
+
+    hole = run_running(priv, position_add(gap_end, -4), position_add(gap_end, -4), 4, -1, position_add(gap_end, -2));
+    KUNIT_EXPECT_EQ(test, hole, position_add(gap_end, -1));
+    KUNIT_EXPECT_TRUE(test, priv->state.running.settling);
+    KUNIT_EXPECT_TRUE(test, priv->state.running.unsure);
+}
+
+// A missed edge is found when the gap is one hole early: count is fixed there.
+static void running_missed_edge_test(struct kunit *test) {
+    struct tagtagtagear_data *priv = test->priv;
+    int gap_end = gap_end_position(1);
+    int hole;
+
+    hole = run_running(priv, position_add(gap_end, -6), position_add(gap_end, -6), 10, position_add(gap_end, -3), -1);
+    KUNIT_EXPECT_EQ(test, hole, position_add(gap_end, 4));
+    KUNIT_EXPECT_TRUE(test, priv->state.running.settling);
+    KUNIT_EXPECT_EQ(test, (int) priv->state.running.position, hole);
+    KUNIT_EXPECT_TRUE(test, priv->command_flags & EAR_DONE_RESYNC);
+}
+
+// Position lost while running is found again at the gap.
+static void running_unknown_position_test(struct kunit *test) {
+    struct tagtagtagear_data *priv = test->priv;
+    int gap_end = gap_end_position(1);
+    int hole;
+
+    hole = run_running(priv, position_add(gap_end, 2), -1, 8, -1, -1);
+    KUNIT_EXPECT_TRUE(test, priv->state.running.settling);
+    KUNIT_EXPECT_EQ(test, (int) priv->state.running.position, -1);
+    hole = run_running(priv, position_add(gap_end, -4), -1, 8, -1, -1);
+    KUNIT_EXPECT_EQ(test, hole, position_add(gap_end, 4));
+    KUNIT_EXPECT_TRUE(test, priv->state.running.settling);
+    KUNIT_EXPECT_EQ(test, (int) priv->state.running.position, hole);
+}
+
+static struct kunit_case tagtagtag_ears_test_cases[] = {
+    KUNIT_CASE(position_add_test),
+    KUNIT_CASE(gap_end_position_test),
+    KUNIT_CASE(detected_previous_position_test),
+    KUNIT_CASE(minimize_delta_test),
+    KUNIT_CASE(find_gap_test),
+    KUNIT_CASE(find_gap_second_delta_test),
+    KUNIT_CASE(find_gap_noisy_test),
+    KUNIT_CASE(find_gap_slow_ear_test),
+    KUNIT_CASE(testing_test),
+    KUNIT_CASE(testing_slow_ear_test),
+    KUNIT_CASE(testing_gap_not_obvious_test),
+    KUNIT_CASE(testing_incoherent_backward_test),
+    KUNIT_CASE(detecting_test),
+    KUNIT_CASE(detecting_slow_noisy_test),
+    KUNIT_CASE(detecting_backward_test),
+    KUNIT_CASE(detecting_from_standstill_test),
+    KUNIT_CASE(running_spurious_edge_test),
+    KUNIT_CASE(running_missed_edge_test),
+    KUNIT_CASE(running_unknown_position_test),
+    {}
+};
+
+static struct kunit_suite tagtagtag_ears_test_suite = {
+    .name = "tagtagtag-ears",
+    .init = ears_test_init,
+    .exit = ears_test_exit,
+    .test_cases = tagtagtag_ears_test_cases,
+};
+
+kunit_test_suite(tagtagtag_ears_test_suite);
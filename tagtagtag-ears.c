@@ -39,14 +39,85 @@
 #include <linux/wait.h>
 #include <linux/uaccess.h>
 #include <linux/poll.h>
+#include <linux/spinlock.h>
+#include <linux/kfifo.h>
+#include <linux/log2.h>
+#include <linux/version.h>
+#include <linux/hrtimer.h>
+#include <linux/pwm.h>
+#include <linux/property.h>
+
+#include "tagtagtag-ears.h"
 
 // Definitions
 
 #define DRV_NAME "tagtagtag-ears"
 #define DEVICE_NAME "ear"
+#define COMBINED_DEVICE_NAME "ears"
 #define NUM_HOLES 17
 #define BROKEN_TIMEOUT_SECS 4
+#define STALL_MIN_MS 100
+#define DEFAULT_STALL_MARGIN 200
+#define DEFAULT_STALL_RETRIES 2
+#define MAX_STALL_RETRIES 7
+#define STALL_BACKOFF_MS 250        // doubled on each retry
+#define DEFAULT_RETEST_INTERVAL 60
+#define MAX_RETEST_INTERVAL 3600
+#define MAX_RETEST_SHIFT 6
 #define EARS_OFFZERO 3
+#define DEFAULT_QUEUE_DEPTH 64
+#define EVENT_QUEUE_DEPTH 64
+#define KEYFRAME_SIZE 4
+#define EDGE_QUEUE_DEPTH 16
+#define DEFAULT_DUTY_CYCLE 100
+#define MAX_BRAKE_MS 100
+#define STOP_LEAD_STEPS 16          // stop lead is learnt by 1/16th of hole period
+#define NUDGE_SHIFT 3               // first correction pulse is 1/8th of hole period
+#define MAX_NUDGES 8                // corrections before giving up on reaching the hole
+#define PERIOD_EWMA_SHIFT 3         // hole periods follow measures with 1/8 weight
+#define PARK_TIMEOUT_MS 6000        // enough for a detection turn and a move
+
+// Parameters
+
+static unsigned int queue_depth = DEFAULT_QUEUE_DEPTH;
+module_param(queue_depth, uint, 0444);
+MODULE_PARM_DESC(queue_depth, "Number of commands that can be queued per ear, rounded up to a power of 2 (default: 64)");
+
+static unsigned int duty_cycle = DEFAULT_DUTY_CYCLE;
+module_param(duty_cycle, uint, 0444);
+MODULE_PARM_DESC(duty_cycle, "Motors duty cycle in %, when driven by PWMs, ears being calibrated at this speed (default: 100)");
+
+static unsigned int approach_duty_cycle = DEFAULT_DUTY_CYCLE;
+module_param(approach_duty_cycle, uint, 0644);
+MODULE_PARM_DESC(approach_duty_cycle, "Motors duty cycle in % when reaching the last hole of a move, when driven by PWMs (default: 100)");
+
+static unsigned int brake_ms;
+module_param(brake_ms, uint, 0644);
+MODULE_PARM_DESC(brake_ms, "Duration in ms of active braking when motors stop, 0 to let ears coast (default: 0)");
+
+static bool early_stop = true;
+module_param(early_stop, bool, 0644);
+MODULE_PARM_DESC(early_stop, "Cut motors before the last hole of a move is reached, with a lead time learnt from overshoots (default: true)");
+
+static bool fast_start;
+module_param(fast_start, bool, 0444);
+MODULE_PARM_DESC(fast_start, "Skip start-up test turn, calibration being restored from sysfs or ears being tested on first command (default: false)");
+
+static int park_position = -1;
+module_param(park_position, int, 0644);
+MODULE_PARM_DESC(park_position, "Position ears are moved to on shutdown and module removal, -1 to leave them (default: -1)");
+
+static unsigned int stall_margin = DEFAULT_STALL_MARGIN;
+module_param(stall_margin, uint, 0644);
+MODULE_PARM_DESC(stall_margin, "Ear is stalled if next hole is not reached within this % of its expected interval (default: 200)");
+
+static unsigned int stall_retries = DEFAULT_STALL_RETRIES;
+module_param(stall_retries, uint, 0644);
+MODULE_PARM_DESC(stall_retries, "Number of times a stalled move is retried, alternatively in the same and opposite direction (default: 2, max: 7)");
+
+static unsigned int retest_interval = DEFAULT_RETEST_INTERVAL;
+module_param(retest_interval, uint, 0644);
+MODULE_PARM_DESC(retest_interval, "Seconds before a broken ear is tested again, doubled after each failure up to an hour, 0 to disable (default: 60)");
 
 // Data structures
 
@@ -73,19 +144,44 @@ struct ear_state_testing {
 struct ear_state_detecting {
     unsigned int new_position:5;    // 0-16
     int direction:2;                // 1: forward, -1: backward
-    int holes_count:5;              // 0-17
+    int holes_count:6;              // 0-17
     enum detecting_post_state_e post_state;
+    unsigned int from_standstill:1; // last_hole_time is when motors started
     ktime_t last_hole_time;
 };
 
 struct ear_state_idle {
     int position:6;         // -1 or 0-16
+    int moved_from:6;       // -1 or 0-16, position before user moved the ear
+    int tracked:6;          // -1 or 0-16, position of last hole crossed by user
+    int direction:2;        // 1: forward, -1: backward, 0: unknown yet
+    unsigned int holes_count:5; // holes crossed by user, modulo NUM_HOLES
+    ktime_t hole_times[3];  // last holes crossed by user, most recent first, or 0
 };
 
 struct ear_state_running {
     int position:6;         // -1 or 0-16
     int direction:2;        // 1: forward, -1: backward
+    unsigned int stop_armed:1;  // stop_timer will cut motors before last hole
+    unsigned int coasting:1;    // motors were cut before last hole
+    unsigned int retries:3;     // stalls recovered from
+    unsigned int backing_off:1; // retry_timer will restart motors
+    unsigned int settling:1;    // motors were cut on last hole, settle_timer checks where the ear stopped
+    unsigned int overshoot:5;   // holes crossed while settling
+    unsigned int nudging:1;     // motors run for a pulse toward last hole, until settle_timer cuts them
+    unsigned int nudges:4;      // corrections of this move
+    unsigned int pulse_shift:3; // correction pulses last hole_period_us >> (NUDGE_SHIFT + pulse_shift)
+    unsigned int unsure:1;      // gap was expected but not crossed, position may be one hole ahead
     uint8_t count; // number of steps to run for
+    ktime_t last_hole_time; // 0 until a hole was crossed
+};
+
+struct ear_command {
+    char command;
+    unsigned char arg;
+    u32 sequence;
+    ktime_t start;                  // CLOCK_MONOTONIC, 0 to start as soon as possible
+    int relative;                   // start is relative to animation start
 };
 
 union ear_state {
@@ -99,105 +195,361 @@ struct tagtagtagear_data {
     struct cdev cdev;
     struct device *device;
     struct gpio_desc *encoder_gpio;
-    struct gpio_descs *motor_gpios;
-	struct timer_list broken_timer;
+    int irq;                                // encoder interrupt, 0 until requested
+    struct gpio_descs *motor_gpios;         // NULL if motors are driven by PWMs
+    struct pwm_device *motor_pwms[2];       // forward, backward
+    struct pwm_state motor_pwm_states[2];
+    unsigned int motor_values[2];   // forward, backward duty cycles (0-100%)
+    int motors_deferred;            // motor_values are applied by combined device
+    bool braking;                   // motors are braking until brake_timer expires
+    // Protects state, commands, events and timers. Timers are soft (they
+    // expire in softirq context) and the state machine runs in the IRQ
+    // thread, so the lock only disables bottom halves, not interrupts.
+    spinlock_t lock;
+    struct hrtimer broken_timer;    // stall detection
+    struct hrtimer start_timer;     // start of scheduled command
+    struct hrtimer brake_timer;     // end of active braking
+    struct hrtimer stop_timer;      // early stop before last hole
+    struct hrtimer settle_timer;    // end of coasting after last hole
+    struct hrtimer retry_timer;     // restart after a stall
+    struct hrtimer retest_timer;    // test broken ear again
+    unsigned int retests;           // failed tests in a row
+    DECLARE_KFIFO(edges, ktime_t, EDGE_QUEUE_DEPTH);    // timestamped by top half
+    bool edges_timestamped;         // top half is called (interrupt is not nested)
+    bool edges_lost;                // edges queue overflowed
     unsigned long detect_boundary_us;
+    unsigned long hole_period_us;   // interval between two holes
+    unsigned long gap_period_us;    // interval across the gap
+    unsigned long stop_lead_us;     // how long before last hole motors are cut
+    unsigned int position_resyncs;  // positions corrected when crossing the gap
 	wait_queue_head_t read_wq;
 	wait_queue_head_t write_wq;
-    int read_result_available;
-    char read_result;
-	char buffer[1];
-	int buffer_size:1;      // 0-1
-	int opened:1;           // 0-1
+    DECLARE_KFIFO(events, struct ear_event, EVENT_QUEUE_DEPTH);
+    bool moved_pending;             // unread EAR_EVENT_MOVED in events
+    DECLARE_KFIFO_PTR(commands, struct ear_command);
+    ktime_t pending_start;          // start time for next queued command
+    int pending_relative;
+    ktime_t animation_start;        // CLOCK_MONOTONIC
+    unsigned char keyframes_left;   // keyframes still to be written
+    int reserved;                   // combined device scheduled a command
+    u32 next_sequence;              // sequence number of last queued command
+    u32 sequence;                   // sequence number of executing command
+    char command;                   // executing command, 0 if none
+    unsigned int command_flags;     // EAR_DONE_* flags of executing command
+    u64 command_start_ns;
+	char buffer[1 + sizeof(u64)];
+	unsigned int buffer_size;       // 0-9
+	unsigned long opened;           // bit 0 is set while the device is open
+	bool event_mode;                // read returns struct ear_event
     enum ear_state_e state_e;
     union ear_state state;
+    // Move statistics, reported when ear goes back to idle.
+    ktime_t move_start_time;        // 0 if not moving
+    ktime_t motors_start_time;      // 0 if motors are stopped
+    unsigned long motors_on_us;
+    unsigned int corrections;
 };
 
 struct tagtagtagears_data {
     dev_t chrdev;
     struct class *ears_class;
     struct tagtagtagear_data ear[2];
+    // Combined device
+    struct cdev cdev;
+    struct device *device;
+    struct gpio_desc *motor_descs[4];       // NULL if any ear uses PWMs
+    struct hrtimer sync_timer;      // start of scheduled command
+    char sync_command;
+    unsigned char sync_args[2];
+    ktime_t pending_start;          // start time for next command
+	char buffer[1 + sizeof(u64)];
+	unsigned int buffer_size;       // 0-9
+	unsigned long opened;           // bit 0 is set while the device is open
 };
 
 // Prototypes
 static void start_motors_backward(struct tagtagtagear_data *priv);
 static void start_motors_forward(struct tagtagtagear_data *priv);
 static void stop_motors(struct tagtagtagear_data *priv);
+static int encoder_is_high(struct tagtagtagear_data *priv);
 
-static void tagtagtagear_broken_timer_cb(struct timer_list *t);
+static enum hrtimer_restart tagtagtagear_broken_timer_cb(struct hrtimer *t);
 static void reset_broken_timer(struct tagtagtagear_data *priv);
+static void stop_broken_timer(struct tagtagtagear_data *priv);
 
 static void transition_to_testing(struct tagtagtagear_data *priv);
 static void transition_to_broken(struct tagtagtagear_data *priv);
 static void transition_to_idle(struct tagtagtagear_data *priv, int position);
 static void transition_to_running(struct tagtagtagear_data *priv, int position, int delta);
+static void transition_to_settling(struct tagtagtagear_data *priv, int position, int direction);
 static void transition_to_detecting(struct tagtagtagear_data *priv, enum detecting_post_state_e post_state, int direction, int new_position);
 
-static void irq_handler_testing(struct tagtagtagear_data *priv);
-static void irq_handler_idle(struct tagtagtagear_data *priv);
-static void irq_handler_running(struct tagtagtagear_data *priv);
-static void irq_handler_detecting(struct tagtagtagear_data *priv);
+static void irq_handler_testing(struct tagtagtagear_data *priv, ktime_t now);
+static void irq_handler_idle(struct tagtagtagear_data *priv, ktime_t now);
+static void irq_handler_running(struct tagtagtagear_data *priv, ktime_t now);
+static void irq_handler_detecting(struct tagtagtagear_data *priv, ktime_t now);
 static irqreturn_t tagtagtagear_irq_handler(int irq, void *dev_id);
+static irqreturn_t tagtagtagear_irq_thread(int irq, void *dev_id);
+
+static void start_settling(struct tagtagtagear_data *priv);
+
+static void run_queue(struct tagtagtagear_data *priv);
 
 static int ear_open(struct inode *inode, struct file *file);
 static int ear_release(struct inode *inode, struct file *file);
 static ssize_t ear_read(struct file *file, char __user *buffer, size_t len, loff_t *offset);
 static ssize_t ear_write(struct file *file, const char __user *buffer, size_t len, loff_t *offset);
 
-static int init_ear(struct device *dev, struct tagtagtagear_data *priv, struct class *ears_class, int major, int minor, const char* encoder_name, const char* motor_name);
+static int init_ear(struct device *dev, struct tagtagtagear_data *priv, struct class *ears_class, int major, int minor, const char* encoder_name, const char* motor_name, const char *const pwm_names[2]);
 static int tagtagtagears_probe(struct platform_device *pdev);
 static int tagtagtagears_remove(struct platform_device *pdev);
+static void tagtagtagears_shutdown(struct platform_device *pdev);
 
 static int position_add(int position, int increment);
+static int gap_end_position(int direction);
+static int find_gap(const unsigned long hole_deltas[NUM_HOLES], unsigned long *max, unsigned long *gap);
+static int detected_previous_position(int holes_count);
+static int minimize_delta(int delta);
 
 // ========================================================================== //
 // Motors
 // ========================================================================== //
 
+// Motors and encoder are only accessed through the functions below, so the
+// state machine does not depend on how the hardware is wired.
+
+static void motors_started(struct tagtagtagear_data *priv) {
+    if (priv->motors_start_time == 0) {
+        priv->motors_start_time = ktime_get_raw();
+    }
+}
+
+static void motors_stopped(struct tagtagtagear_data *priv) {
+    if (priv->motors_start_time != 0) {
+        priv->motors_on_us += ktime_us_delta(ktime_get_raw(), priv->motors_start_time);
+        priv->motors_start_time = 0;
+    }
+}
+
+// Apply motor_values. PWMs must be usable in atomic context.
+static void write_motors(struct tagtagtagear_data *priv) {
+    int ix;
+    for (ix = 0; ix < 2; ix++) {
+        if (priv->motor_pwms[ix]) {
+            struct pwm_state *state = &priv->motor_pwm_states[ix];
+            pwm_set_relative_duty_cycle(state, priv->motor_values[ix], 100);
+            state->enabled = priv->motor_values[ix] > 0;
+            pwm_apply_state(priv->motor_pwms[ix], state);
+        } else {
+            gpiod_set_value(priv->motor_gpios->desc[ix], priv->motor_values[ix] > 0);
+        }
+    }
+}
+
+// Set motors duty cycles, unless combined device will set them for both ears.
+static void set_motors(struct tagtagtagear_data *priv, unsigned int forward, unsigned int backward) {
+    priv->motor_values[0] = forward;
+    priv->motor_values[1] = backward;
+    if (!priv->motors_deferred) {
+        write_motors(priv);
+    }
+}
+
+// Duty cycle for current state: slow down before the last hole.
+// Testing and detecting always use duty_cycle, as detect_boundary_us is only
+// valid for this speed.
+static unsigned int motors_duty_cycle(struct tagtagtagear_data *priv) {
+    unsigned int duty = duty_cycle;
+    if (priv->state_e == running && priv->state.running.count == 1) {
+        duty = approach_duty_cycle;
+    }
+    return clamp_val(duty, 1, 100);
+}
+
 static void start_motors_backward(struct tagtagtagear_data *priv) {
-    gpiod_set_value(priv->motor_gpios->desc[0], 0);
-    gpiod_set_value(priv->motor_gpios->desc[1], 1);
+    motors_started(priv);
+    priv->braking = false;
+    set_motors(priv, 0, motors_duty_cycle(priv));
 }
 
 static void start_motors_forward(struct tagtagtagear_data *priv) {
-    gpiod_set_value(priv->motor_gpios->desc[0], 1);
-    gpiod_set_value(priv->motor_gpios->desc[1], 0);
+    motors_started(priv);
+    priv->braking = false;
+    set_motors(priv, motors_duty_cycle(priv), 0);
 }
 
+// Stop motors. If brake_ms is set and motors were running, short the motor
+// by driving both inputs high, and release them when brake_timer expires.
 static void stop_motors(struct tagtagtagear_data *priv) {
-    gpiod_set_value(priv->motor_gpios->desc[0], 0);
-    gpiod_set_value(priv->motor_gpios->desc[1], 0);
+    unsigned int brake = min(brake_ms, (unsigned int) MAX_BRAKE_MS);
+    if (brake && priv->motors_start_time != 0) {
+        priv->braking = true;
+        set_motors(priv, 100, 100);
+        hrtimer_start(&priv->brake_timer, ms_to_ktime(brake), HRTIMER_MODE_REL_SOFT);
+    } else if (!priv->braking) {
+        set_motors(priv, 0, 0);
+    }
+    motors_stopped(priv);
+}
+
+static enum hrtimer_restart tagtagtagear_brake_timer_cb(struct hrtimer *t) {
+    struct tagtagtagear_data *priv = container_of(t, struct tagtagtagear_data, brake_timer);
+    spin_lock(&priv->lock);
+    if (priv->braking) {
+        priv->braking = false;
+        set_motors(priv, 0, 0);
+    }
+    spin_unlock(&priv->lock);
+    return HRTIMER_NORESTART;
+}
+
+// ========================================================================== //
+// Encoder
+// ========================================================================== //
+
+// Signal is high between holes and low on holes.
+static int encoder_is_high(struct tagtagtagear_data *priv) {
+    return gpiod_get_value(priv->encoder_gpio);
 }
 
 // ========================================================================== //
 // Broken timer
 // ========================================================================== //
 
+//
+// Stall recovery
+//
+// When running, a stalled ear (e.g. held by a child) is given stall_retries
+// more chances: motors are stopped and restarted after a backoff, doubled
+// each time. Odd retries go on in the same direction, even retries reach the
+// target the other way around, unless it is the next hole. The done event is
+// flagged with EAR_DONE_RETRY.
+//
+static void retry_running(struct tagtagtagear_data *priv) {
+    priv->state.running.retries++;
+    priv->state.running.backing_off = 1;
+    priv->state.running.stop_armed = 0;
+    priv->state.running.coasting = 0;
+    priv->command_flags |= EAR_DONE_RETRY;
+    dev_dbg(priv->device, "stalled, retry %u", priv->state.running.retries);
+    hrtimer_start(&priv->retry_timer, ms_to_ktime(STALL_BACKOFF_MS << (priv->state.running.retries - 1)), HRTIMER_MODE_REL_SOFT);
+}
+
+static enum hrtimer_restart tagtagtagear_retry_timer_cb(struct hrtimer *t) {
+    struct tagtagtagear_data *priv = container_of(t, struct tagtagtagear_data, retry_timer);
+    spin_lock(&priv->lock);
+    if (priv->state_e == running && priv->state.running.backing_off) {
+        priv->state.running.backing_off = 0;
+        if ((priv->state.running.retries & 1) == 0) {
+            // Ear is between last hole reached and next one. Reverse if the
+            // target is closer the other way around: first hole will be last
+            // hole reached again. Otherwise go on.
+            int delta = minimize_delta(priv->state.running.count);
+            if (delta < 0) {
+                priv->state.running.count = 1 - delta;
+                if (priv->state.running.position != -1) {
+                    priv->state.running.position = position_add(priv->state.running.position, priv->state.running.direction);
+                }
+                priv->state.running.direction = -priv->state.running.direction;
+            }
+        }
+        // Motors restart from standstill.
+        priv->state.running.last_hole_time = 0;
+        if (priv->state.running.direction > 0) {
+            start_motors_forward(priv);
+        } else {
+            start_motors_backward(priv);
+        }
+        reset_broken_timer(priv);
+    }
+    spin_unlock(&priv->lock);
+    return HRTIMER_NORESTART;
+}
+
 //
 // Callback when timer is fired.
 // In testing mode, declare ear as broken.
+// In running mode, retry a few times.
 // In any other mode, transition to idle with unknown position.
 // Always stop motors.
 //
-static void tagtagtagear_broken_timer_cb(struct timer_list *t) {
-    struct tagtagtagear_data *priv = from_timer(priv, t, broken_timer);
-    stop_motors(priv);
-    if (priv->state_e == testing) {
-        dev_err(priv->device, "timeout, declaring ear as broken");
-        transition_to_broken(priv);
-    } else {
-        dev_err(priv->device, "timeout, giving up (position is thereupon unknown)");
-        transition_to_idle(priv, -1);
+// Timer is stopped or re-armed with the lock held, so we may have been waiting
+// for the lock while the ear reached a hole: ignore the timeout then.
+//
+static enum hrtimer_restart tagtagtagear_broken_timer_cb(struct hrtimer *t) {
+    struct tagtagtagear_data *priv = container_of(t, struct tagtagtagear_data, broken_timer);
+    spin_lock(&priv->lock);
+    if (!hrtimer_is_queued(&priv->broken_timer) && priv->state_e != idle && priv->state_e != broken) {
+        stop_motors(priv);
+        if (priv->state_e == testing) {
+            dev_err(priv->device, "timeout, declaring ear as broken");
+            transition_to_broken(priv);
+        } else if (priv->state_e == running && priv->state.running.retries < min(stall_retries, (unsigned int) MAX_STALL_RETRIES)) {
+            retry_running(priv);
+        } else {
+            dev_err(priv->device, "timeout, giving up (position is thereupon unknown)");
+            priv->command_flags |= EAR_DONE_FAILED;
+            transition_to_idle(priv, -1);
+            run_queue(priv);
+        }
+    }
+    spin_unlock(&priv->lock);
+    return HRTIMER_NORESTART;
+}
+
+// Whether the last hole of a move is reached at another speed. Duty cycles
+// only apply to PWMs: GPIOs always drive motors at full speed.
+static bool approach_differs(struct tagtagtagear_data *priv) {
+    return priv->motor_pwms[0] && approach_duty_cycle != duty_cycle;
+}
+
+// Interval measured at duty_cycle, scaled for the last hole of a move if the
+// ear is then slowed down to approach_duty_cycle.
+static unsigned long approach_period_us(struct tagtagtagear_data *priv, unsigned long period_us) {
+    if (approach_differs(priv) && approach_duty_cycle < duty_cycle && approach_duty_cycle > 0) {
+        period_us = period_us * duty_cycle / approach_duty_cycle;
+    }
+    return period_us;
+}
+
+// Expected interval until next hole, in usec, or 0 if it cannot be told.
+// Once ear is calibrated, this is the gap period unless we know next hole is
+// a regular one, scaled if the ear is slowed down for the last hole.
+static unsigned long expected_hole_us(struct tagtagtagear_data *priv) {
+    unsigned long period_us = priv->gap_period_us;
+    if (priv->state_e == testing || priv->hole_period_us == 0) {
+        return 0;
     }
+    if (priv->state_e == running) {
+        if (priv->state.running.position != -1 && priv->state.running.direction != 0
+            && priv->state.running.last_hole_time != 0
+            && position_add(priv->state.running.position, priv->state.running.direction) != gap_end_position(priv->state.running.direction)) {
+            period_us = priv->hole_period_us;
+        }
+        if (priv->state.running.count == 1) {
+            period_us = approach_period_us(priv, period_us);
+        }
+    }
+    return period_us;
 }
 
+// (Re-)arm stall detection for next hole.
 static void reset_broken_timer(struct tagtagtagear_data *priv) {
-    del_timer_sync(&priv->broken_timer);
-    mod_timer(&priv->broken_timer, jiffies + BROKEN_TIMEOUT_SECS * HZ);
+    u64 timeout_us = expected_hole_us(priv) * stall_margin / 100;
+    if (timeout_us == 0 || timeout_us > BROKEN_TIMEOUT_SECS * USEC_PER_SEC) {
+        timeout_us = BROKEN_TIMEOUT_SECS * USEC_PER_SEC;
+    } else if (timeout_us < STALL_MIN_MS * USEC_PER_MSEC) {
+        timeout_us = STALL_MIN_MS * USEC_PER_MSEC;
+    }
+    hrtimer_start(&priv->broken_timer, us_to_ktime(timeout_us), HRTIMER_MODE_REL_SOFT);
+}
+
+static void stop_broken_timer(struct tagtagtagear_data *priv) {
+    hrtimer_try_to_cancel(&priv->broken_timer);
 }
 
 // ========================================================================== //
-// State transitions
+// Positions
 // ========================================================================== //
 
 static int position_add(int position, int increment) {
@@ -210,42 +562,211 @@ static int position_add(int position, int increment) {
     return result;
 }
 
+// Position of the hole reached after crossing the gap in given direction.
+static int gap_end_position(int direction) {
+    return direction > 0 ? NUM_HOLES - EARS_OFFZERO : NUM_HOLES - 1 - EARS_OFFZERO;
+}
+
+// Find the gap in hole deltas measured during a full forward turn.
+// We should have 16 approximatively equivalent deltas and one at least twice
+// larger. Return the index of the largest delta (the gap) and set max to the
+// largest of the other deltas.
+static int find_gap(const unsigned long hole_deltas[NUM_HOLES], unsigned long *max, unsigned long *gap) {
+    unsigned long min;
+    int gap_ix = 0;
+    int ix;
+
+    min = min(hole_deltas[0], hole_deltas[1]);
+    *max = min;
+    *gap = max(hole_deltas[0], hole_deltas[1]);
+    if (hole_deltas[1] > hole_deltas[0]) {
+        gap_ix = 1;
+    }
+    for (ix = 2; ix < NUM_HOLES; ix++) {
+        unsigned long this_delta = hole_deltas[ix];
+        if (min > this_delta) {
+            min = this_delta;
+        } else if (*gap < this_delta) {
+            *max = *gap;
+            *gap = this_delta;
+            gap_ix = ix;
+        } else if (*max < this_delta) {
+            *max = this_delta;
+        }
+    }
+    return gap_ix;
+}
+
+// Position of the ear before a detection, knowing it crossed holes_count
+// holes forward before reaching the gap (at -EARS_OFFZERO).
+// x + holes_count = NUM_HOLES - EARS_OFFZERO
+static int detected_previous_position(int holes_count) {
+    int previous_position = NUM_HOLES - holes_count - EARS_OFFZERO;
+    if (previous_position < 0) {
+        previous_position += NUM_HOLES;
+    }
+    return previous_position;
+}
+
+// Minimize movement: never run more than half a turn.
+static int minimize_delta(int delta) {
+    while (delta > 9) {
+        delta -= NUM_HOLES;
+    }
+    while (delta < -9) {
+        delta += NUM_HOLES;
+    }
+    return delta;
+}
+
+// ========================================================================== //
+// Events
+// ========================================================================== //
+
+// Queue an event for reader. If queue is full, oldest event is dropped.
+static void queue_event(struct tagtagtagear_data *priv, struct ear_event *event) {
+    if (kfifo_is_full(&priv->events)) {
+        struct ear_event dropped;
+        if (kfifo_get(&priv->events, &dropped) && dropped.type == EAR_EVENT_MOVED) {
+            priv->moved_pending = 0;
+        }
+    }
+    kfifo_put(&priv->events, *event);
+    wake_up_interruptible(&priv->read_wq);
+}
+
+static void push_event(struct tagtagtagear_data *priv, unsigned char type, int position) {
+    struct ear_event event = {
+        .time_ns = ktime_get_ns(),
+        .sequence = type == EAR_EVENT_POSITION ? priv->sequence : 0,
+        .type = type,
+        .position = position,
+    };
+    queue_event(priv, &event);
+}
+
+// Signal ear was moved by user, unless reader was not told about a previous
+// move yet.
+static void push_moved_event(struct tagtagtagear_data *priv) {
+    if (!priv->moved_pending) {
+        push_event(priv, EAR_EVENT_MOVED, -1);
+        priv->moved_pending = 1;
+    }
+}
+
+// Signal executing command completed, with its final position.
+// Completion events are only reported in event mode.
+static void complete_command(struct tagtagtagear_data *priv, int position) {
+    if (priv->command == 0) {
+        return;
+    }
+    if (priv->corrections > 0) {
+        priv->command_flags |= EAR_DONE_CORRECTION;
+    }
+    if (priv->event_mode) {
+        struct ear_event event = {
+            .time_ns = ktime_get_ns(),
+            .start_time_ns = priv->command_start_ns,
+            .sequence = priv->sequence,
+            .motors_on_us = min_t(unsigned long, priv->motors_on_us, U32_MAX),
+            .type = EAR_EVENT_DONE,
+            .position = position,
+            .command = priv->command,
+            .flags = priv->command_flags,
+        };
+        queue_event(priv, &event);
+    }
+    priv->command = 0;
+}
+
+// ========================================================================== //
+// State transitions
+// ========================================================================== //
+
 // Get position, setting it to unknown if gpio is high.
 static int get_idle_position(struct tagtagtagear_data *priv) {
-    int is_high = gpiod_get_value(priv->encoder_gpio);
+    int is_high = encoder_is_high(priv);
     if (is_high && priv->state.idle.position != -1) {
         // Ear was moved.
         priv->state.idle.position = -1;
-        if (priv->read_result_available == 0) {
-            priv->read_result_available = 1;
-            priv->read_result = 'm';
-            wake_up_interruptible(&priv->read_wq);
-        }
+        push_moved_event(priv);
     }
     return priv->state.idle.position;
 }
 
+// Record the beginning of a move (from idle or at startup).
+static void begin_move(struct tagtagtagear_data *priv) {
+    if (priv->move_start_time == 0) {
+        priv->move_start_time = ktime_get_raw();
+        priv->motors_on_us = 0;
+        priv->corrections = 0;
+    }
+}
+
+// Report statistics of the move that just ended, if any.
+static void end_move(struct tagtagtagear_data *priv, int position) {
+    if (priv->move_start_time != 0) {
+        dev_dbg(priv->device, "move ended at %d after %lld usec (motors on %lu usec, %u correction(s))",
+            position, ktime_us_delta(ktime_get_raw(), priv->move_start_time), priv->motors_on_us, priv->corrections);
+        priv->move_start_time = 0;
+    }
+}
+
 static void transition_to_testing(struct tagtagtagear_data *priv) {
+    begin_move(priv);
     priv->state_e = testing;
     memset(&priv->state, 0, sizeof(priv->state));
     reset_broken_timer(priv);
     start_motors_forward(priv);
 }
 
+// Broken state is left when the ear is tested again, after retest_interval
+// seconds, doubled after each failed test. Readers are told when the ear
+// breaks, not after each failed test.
 static void transition_to_broken(struct tagtagtagear_data *priv) {
+    priv->command_flags |= EAR_DONE_FAILED;
+    complete_command(priv, -1);
+    priv->move_start_time = 0;
     priv->state_e = broken;
     memset(&priv->state, 0, sizeof(priv->state));
-    wake_up_interruptible(&priv->write_wq);
+    kfifo_reset(&priv->commands);
+    if (priv->retests == 0) {
+        push_event(priv, EAR_EVENT_BROKEN, -1);
+    }
+    if (retest_interval) {
+        u64 delay = min((u64) retest_interval << priv->retests, (u64) MAX_RETEST_INTERVAL);
+        hrtimer_start(&priv->retest_timer, ktime_set(delay, 0), HRTIMER_MODE_REL_SOFT);
+    }
+    if (priv->retests < MAX_RETEST_SHIFT) {
+        priv->retests++;
+    }
+    wake_up(&priv->write_wq);
+}
+
+static enum hrtimer_restart tagtagtagear_retest_timer_cb(struct hrtimer *t) {
+    struct tagtagtagear_data *priv = container_of(t, struct tagtagtagear_data, retest_timer);
+    spin_lock(&priv->lock);
+    if (priv->state_e == broken) {
+        dev_info(priv->device, "testing broken ear again");
+        transition_to_testing(priv);
+    }
+    spin_unlock(&priv->lock);
+    return HRTIMER_NORESTART;
 }
 
 static void transition_to_idle(struct tagtagtagear_data *priv, int position) {
+    end_move(priv, position);
+    complete_command(priv, position);
     priv->state_e = idle;
     memset(&priv->state, 0, sizeof(priv->state));
     priv->state.idle.position = position;
-    wake_up_interruptible(&priv->write_wq);
+    priv->state.idle.moved_from = position;
+    priv->state.idle.tracked = -1;
+    wake_up(&priv->write_wq);
 }
 
 static void transition_to_running(struct tagtagtagear_data *priv, int position, int delta) {
+    begin_move(priv);
     priv->state_e = running;
     memset(&priv->state, 0, sizeof(priv->state));
     priv->state.running.position = position;
@@ -258,18 +779,31 @@ static void transition_to_running(struct tagtagtagear_data *priv, int position,
         priv->state.running.count = -delta;
         priv->state.running.direction = -1;
         start_motors_backward(priv);
+    } else if (priv->motors_start_time != 0) {
+        // Transitioned from detecting: the ear is on the hole, but moving.
+        int direction = priv->motor_values[0] ? 1 : -1;
+        stop_broken_timer(priv);
+        stop_motors(priv);
+        transition_to_settling(priv, position, direction);
     } else {
-        del_timer_sync(&priv->broken_timer);
-        stop_motors(priv);  // We need to stop motors if we transitioned from detecting.
-        if (priv->read_result_available == 1) {
-            priv->read_result = position;
-        }
+        stop_broken_timer(priv);
         transition_to_idle(priv, position);
     }
 }
 
+// Motors were just cut on a hole: check where the ear settles before going idle.
+static void transition_to_settling(struct tagtagtagear_data *priv, int position, int direction) {
+    priv->state_e = running;
+    memset(&priv->state, 0, sizeof(priv->state));
+    priv->state.running.position = position;
+    priv->state.running.direction = direction;
+    start_settling(priv);
+}
+
 static void transition_to_detecting(struct tagtagtagear_data *priv, enum detecting_post_state_e post_state, int direction, int new_position) {
-    int is_high = gpiod_get_value(priv->encoder_gpio);
+    int is_high = encoder_is_high(priv);
+    begin_move(priv);
+    priv->command_flags |= EAR_DONE_DETECTION;
     priv->state_e = detecting;
     memset(&priv->state, 0, sizeof(priv->state));
     priv->state.detecting.post_state = post_state;
@@ -279,6 +813,7 @@ static void transition_to_detecting(struct tagtagtagear_data *priv, enum detecti
         priv->state.detecting.last_hole_time = 0;
     } else {
         priv->state.detecting.last_hole_time = ktime_get_raw();
+        priv->state.detecting.from_standstill = 1;
     }
     reset_broken_timer(priv);
     if (direction > 0) {
@@ -304,43 +839,24 @@ static void transition_to_detecting(struct tagtagtagear_data *priv, enum detecti
 //
 // At every hole, reset broken ear timer.
 //
-static void irq_handler_testing(struct tagtagtagear_data *priv) {
+static void irq_handler_testing(struct tagtagtagear_data *priv, ktime_t now) {
     if (priv->state.testing.last_hole_time == 0) {
-        priv->state.testing.last_hole_time = ktime_get_raw();
+        priv->state.testing.last_hole_time = now;
         reset_broken_timer(priv);
     } else {
-        ktime_t now = ktime_get_raw();
         if (priv->state.testing.holes_count < NUM_HOLES) {
             priv->state.testing.hole_deltas[priv->state.testing.holes_count] = ktime_us_delta(now, priv->state.testing.last_hole_time);
             priv->state.testing.last_hole_time = now;
             priv->state.testing.holes_count++;
 
             if (priv->state.testing.holes_count == NUM_HOLES) {
-                unsigned long min, max, gap, half_max, first_delta, second_delta;
-                int gap_ix = 0;
-                int ix;
+                unsigned long max, gap, half_max;
+                int gap_ix;
 
                 // End of forward testing. Stop motors.
-                del_timer_sync(&priv->broken_timer);
+                stop_broken_timer(priv);
                 stop_motors(priv);
-                // We should have 16 approximatively equivalent deltas and one at least twice larger.
-                first_delta = priv->state.testing.hole_deltas[0];
-                second_delta = priv->state.testing.hole_deltas[1];
-                min = min(first_delta, second_delta);
-                max = min;
-                gap = max(first_delta, second_delta);
-                for (ix = 2; ix < NUM_HOLES; ix++) {
-                    unsigned long this_delta = priv->state.testing.hole_deltas[ix];
-                    if (min > this_delta) {
-                        min = this_delta;
-                    } else if (gap < this_delta) {
-                        max = gap;
-                        gap = this_delta;
-                        gap_ix = ix;
-                    } else if (max < this_delta) {
-                        max = this_delta;
-                    }
-                }
+                gap_ix = find_gap(priv->state.testing.hole_deltas, &max, &gap);
                 half_max = max >> 1;
                 if (gap < (max + half_max)) {
                     dev_err(priv->device, "gap is not obvious (max = %lu, gap = %lu), declaring ear as broken", max, gap);
@@ -348,12 +864,10 @@ static void irq_handler_testing(struct tagtagtagear_data *priv) {
                 } else {
                     // if gap_ix was the first delta (0), we ran a full turn and position is 16-EARS_OFFZERO
                     // if gap_ix was the last delta (16), we are at 0-EARS_OFFZERO.
-                    int forward_position = NUM_HOLES - 1 - gap_ix - EARS_OFFZERO;
-                    if (forward_position < 0) {
-                        forward_position += NUM_HOLES;
-                    }
-                    priv->state.testing.forward_position = forward_position;
+                    priv->state.testing.forward_position = position_add(NUM_HOLES - 1 - EARS_OFFZERO, -gap_ix);
                     priv->detect_boundary_us = (max + gap) >> 1;
+                    priv->hole_period_us = max;
+                    priv->gap_period_us = gap;
                     if (priv->detect_boundary_us > 1000000) {
                         dev_warn(priv->device, "Ear is abnormally slow (gap = %lu usec, typically 800ms)", gap);
                     }
@@ -369,7 +883,7 @@ static void irq_handler_testing(struct tagtagtagear_data *priv) {
             int position;
             // We were running backward one position to test backward motor.
             // End of backward testing. Stop motors.
-            del_timer_sync(&priv->broken_timer);
+            stop_broken_timer(priv);
             stop_motors(priv);
             if (priv->state.testing.forward_position == NUM_HOLES - EARS_OFFZERO) {
                 if (backward_delta < priv->detect_boundary_us) {
@@ -384,10 +898,11 @@ static void irq_handler_testing(struct tagtagtagear_data *priv) {
             }
             position = position_add(priv->state.testing.forward_position, -1);
             if (broken == 0) {
-                if (priv->read_result_available == 1) {
-                    priv->read_result = position;
+                if (priv->retests) {
+                    push_event(priv, EAR_EVENT_RECOVERED, position);
+                    priv->retests = 0;
                 }
-                transition_to_idle(priv, position);
+                transition_to_settling(priv, position, -1);
             } else {
                 transition_to_broken(priv);
             }
@@ -395,19 +910,254 @@ static void irq_handler_testing(struct tagtagtagear_data *priv) {
     }
 }
 
+//
+// Check whether the user just turned the ear through the gap, and return the
+// direction (1 or -1), or 0.
+//
+// The interval before the previous hole is the gap if it is much longer than
+// the last one (as with hole and gap periods), and if the number of holes
+// crossed from moved_from leads to the gap in that direction. Direction is
+// ambiguous when both directions lead to the gap after the same count.
+//
+static int idle_crossed_gap(struct tagtagtagear_data *priv) {
+    struct ear_state_idle *idle = &priv->state.idle;
+    int holes_count = idle->holes_count - 1;
+    unsigned long gap_delta, next_delta;
+    int forward, backward;
+
+    if (idle->moved_from == -1 || idle->hole_times[2] == 0)
+        return 0;
+    gap_delta = ktime_us_delta(idle->hole_times[1], idle->hole_times[2]);
+    next_delta = ktime_us_delta(idle->hole_times[0], idle->hole_times[1]);
+    if (gap_delta * 2 * priv->hole_period_us <= next_delta * (priv->hole_period_us + priv->gap_period_us))
+        return 0;
+    forward = position_add(idle->moved_from, holes_count) == gap_end_position(1);
+    backward = position_add(idle->moved_from, -holes_count) == gap_end_position(-1);
+    if (forward == backward)
+        return 0;
+    return forward ? 1 : -1;
+}
+
 //
 // IRQ Handler in idle state
 //
-// User moved the ear. Position is now unknown.
-// Signal blocked reader if read_result_available is clear.
+// User moved the ear. Position is unknown until the user turns the ear
+// through the gap, and then follows holes assuming user keeps turning in the
+// same direction.
+// Signal reader unless it was not told about a previous move yet.
+//
+static void irq_handler_idle(struct tagtagtagear_data *priv, ktime_t now) {
+    struct ear_state_idle *idle = &priv->state.idle;
+    idle->hole_times[2] = idle->hole_times[1];
+    idle->hole_times[1] = idle->hole_times[0];
+    idle->hole_times[0] = now;
+    idle->holes_count = position_add(idle->holes_count, 1);
+    if (idle->direction == 0) {
+        idle->direction = idle_crossed_gap(priv);
+        if (idle->direction != 0) {
+            // Previous hole was at the end of the gap.
+            idle->tracked = gap_end_position(idle->direction);
+        }
+    }
+    if (idle->direction != 0) {
+        idle->tracked = position_add(idle->tracked, idle->direction);
+    }
+    idle->position = idle->tracked;
+    push_moved_event(priv);
+}
+
+//
+// Calibration
+//
+// detect_boundary_us is first computed by the self-test turn. Motor speed
+// then drifts with temperature, wear and supply voltage, so hole and gap
+// periods follow every interval measured at cruise speed while running or
+// detecting, and the boundary is kept halfway between them. Intervals too far
+// from the current estimates (ear blocked or pushed) are ignored.
+//
+static void update_hole_period(struct tagtagtagear_data *priv, unsigned long delta_us, int is_gap) {
+    unsigned long *period = is_gap ? &priv->gap_period_us : &priv->hole_period_us;
+    if (delta_us < priv->hole_period_us / 2 || delta_us > priv->gap_period_us * 2)
+        return;
+    if (delta_us > *period) {
+        *period += (delta_us - *period) >> PERIOD_EWMA_SHIFT;
+    } else {
+        *period -= (*period - delta_us) >> PERIOD_EWMA_SHIFT;
+    }
+    priv->detect_boundary_us = (priv->hole_period_us + priv->gap_period_us) >> 1;
+}
+
+//
+// Gap verification
+//
+// While running at cruise speed, the interval before each hole tells whether
+// the gap was just crossed. If this contradicts the position, a hole was
+// missed or a spurious edge was counted. When the gap was expected but not
+// crossed, position is one hole ahead or the gap interval was mismeasured:
+// it is kept until the gap is crossed, and reported unknown if the move ends
+// first. When the gap was crossed, position is known again (even if it was
+// unknown) and the remaining count is fixed to reach the same final position.
+//
+static void resync_position(struct tagtagtagear_data *priv, int position) {
+    int old_position = priv->state.running.position;
+    priv->position_resyncs++;
+    priv->command_flags |= EAR_DONE_RESYNC;
+    dev_dbg(priv->device, "position %d corrected to %d while running (%u corrections)",
+        old_position, position, priv->position_resyncs);
+    if (old_position != -1) {
+        int count = priv->state.running.count + minimize_delta(old_position - position) * priv->state.running.direction;
+        if (count < 0) {
+            // Final position was passed, reach it on next turn.
+            count += NUM_HOLES;
+        }
+        priv->state.running.count = count;
+    }
+    priv->state.running.position = position;
+    priv->state.running.unsure = 0;
+}
+
+//
+// Early stop
+//
+// Inertia carries the ear past the last hole when motors are cut on its edge.
+// When the last hole is next, cut motors stop_lead_us before its expected
+// edge, computed from the previous interval (scaled if either crosses the gap,
+// and if the ear is slowed down for the last hole).
+// stop_lead_us grows when the ear still overshoots once settled, and shrinks
+// when it stops before the hole, in which case motors are restarted.
+//
+static void arm_early_stop(struct tagtagtagear_data *priv, unsigned long last_delta_us) {
+    unsigned long period_us = last_delta_us;
+    int next_position;
+    if (!early_stop || priv->stop_lead_us == 0 || priv->state.running.position == -1)
+        return;
+    next_position = position_add(priv->state.running.position, priv->state.running.direction);
+    if (next_position == gap_end_position(priv->state.running.direction)) {
+        // Crossing the gap, previous interval was a regular one.
+        period_us = period_us * priv->gap_period_us / max(priv->hole_period_us, 1UL);
+    } else if (last_delta_us >= priv->detect_boundary_us) {
+        // Previous interval was the gap.
+        period_us = period_us * priv->hole_period_us / max(priv->gap_period_us, 1UL);
+    }
+    period_us = approach_period_us(priv, period_us);
+    if (period_us <= priv->stop_lead_us)
+        return;
+    priv->state.running.stop_armed = 1;
+    hrtimer_start(&priv->stop_timer, us_to_ktime(period_us - priv->stop_lead_us), HRTIMER_MODE_REL_SOFT);
+}
+
+static enum hrtimer_restart tagtagtagear_stop_timer_cb(struct hrtimer *t) {
+    struct tagtagtagear_data *priv = container_of(t, struct tagtagtagear_data, stop_timer);
+    enum hrtimer_restart ret = HRTIMER_NORESTART;
+    spin_lock(&priv->lock);
+    if (priv->state_e == running && priv->state.running.stop_armed) {
+        if (!priv->state.running.coasting) {
+            // Cut motors and check the ear reached the hole one period later.
+            stop_motors(priv);
+            priv->state.running.coasting = 1;
+            reset_broken_timer(priv);
+            hrtimer_forward_now(t, us_to_ktime(approach_period_us(priv, priv->hole_period_us)));
+            ret = HRTIMER_RESTART;
+        } else {
+            // Ear stopped before the hole: cut motors later next time.
+            priv->stop_lead_us -= min(priv->stop_lead_us, 2 * priv->hole_period_us / STOP_LEAD_STEPS);
+            priv->state.running.stop_armed = 0;
+            priv->state.running.coasting = 0;
+            priv->state.running.last_hole_time = 0;
+            if (priv->state.running.direction > 0) {
+                start_motors_forward(priv);
+            } else {
+                start_motors_backward(priv);
+            }
+            reset_broken_timer(priv);
+        }
+    }
+    spin_unlock(&priv->lock);
+    return ret;
+}
+
+//
+// Settling
+//
+// Motors are cut when the last hole is reached, but inertia may carry the ear
+// past it. Where the ear stopped is checked settle_us after the last edge:
+// between holes or on a later hole, it overshot. stop_lead_us then grows, and
+// the ear is moved back to the last hole.
+// When the ear is next to the last hole, it is moved with a short pulse of
+// the motors and left to coast, as running until the hole would overshoot
+// again. Pulses are halved after each overshoot, and repeated when the ear
+// stops before the hole.
 //
-static void irq_handler_idle(struct tagtagtagear_data *priv) {
-    priv->state.idle.position = -1;
-    if (priv->read_result_available == 0) {
-        priv->read_result_available = 1;
-        priv->read_result = 'm';
-        wake_up_interruptible(&priv->read_wq);
+static unsigned long settle_us(struct tagtagtagear_data *priv) {
+    return 3 * priv->hole_period_us / 2 + min(brake_ms, (unsigned int) MAX_BRAKE_MS) * USEC_PER_MSEC;
+}
+
+static void start_settling(struct tagtagtagear_data *priv) {
+    priv->state.running.settling = 1;
+    priv->state.running.nudging = 0;
+    hrtimer_start(&priv->settle_timer, us_to_ktime(settle_us(priv)), HRTIMER_MODE_REL_SOFT);
+}
+
+static void correct_position(struct tagtagtagear_data *priv, int is_high) {
+    if (priv->state.running.count == 0) {
+        // Overshoot: move back to the last hole. Between holes, the first edge
+        // is the hole the ear just left.
+        if (priv->state.running.nudges == 0) {
+            if (early_stop) {
+                // Cut motors earlier next time.
+                priv->stop_lead_us = min(priv->stop_lead_us + priv->hole_period_us / STOP_LEAD_STEPS, priv->hole_period_us / 2);
+            }
+        } else if (NUDGE_SHIFT + priv->state.running.pulse_shift < 7) {
+            priv->state.running.pulse_shift++;
+        }
+        priv->state.running.count = priv->state.running.overshoot + is_high;
+        if (is_high && priv->state.running.position != -1) {
+            priv->state.running.position = position_add(priv->state.running.position, priv->state.running.direction);
+        }
+        priv->state.running.direction = -priv->state.running.direction;
+    }
+    // Otherwise, the ear stopped before the last hole: keep going.
+    priv->corrections++;
+    priv->state.running.nudges++;
+    priv->state.running.settling = 0;
+    priv->state.running.overshoot = 0;
+    priv->state.running.last_hole_time = 0;   // motors restart from standstill
+    if (priv->state.running.direction > 0) {
+        start_motors_forward(priv);
+    } else {
+        start_motors_backward(priv);
+    }
+    reset_broken_timer(priv);
+    if (priv->state.running.count == 1) {
+        priv->state.running.nudging = 1;
+        hrtimer_start(&priv->settle_timer, us_to_ktime(priv->hole_period_us >> (NUDGE_SHIFT + priv->state.running.pulse_shift)), HRTIMER_MODE_REL_SOFT);
+    }
+}
+
+static enum hrtimer_restart tagtagtagear_settle_timer_cb(struct hrtimer *t) {
+    struct tagtagtagear_data *priv = container_of(t, struct tagtagtagear_data, settle_timer);
+    spin_lock(&priv->lock);
+    if (priv->state_e == running && priv->state.running.nudging) {
+        // End of correction pulse.
+        stop_broken_timer(priv);
+        stop_motors(priv);
+        start_settling(priv);
+    } else if (priv->state_e == running && priv->state.running.settling) {
+        int is_high = encoder_is_high(priv);
+        if (!is_high && priv->state.running.count == 0 && priv->state.running.overshoot == 0) {
+            transition_to_idle(priv, priv->state.running.unsure ? -1 : priv->state.running.position);
+            run_queue(priv);
+        } else if (priv->state.running.nudges == MAX_NUDGES) {
+            // Give up, on the hole the ear stopped on if any.
+            dev_warn(priv->device, "cannot stop ear on hole");
+            transition_to_idle(priv, is_high || priv->state.running.unsure ? -1 : priv->state.running.position);
+            run_queue(priv);
+        } else {
+            correct_position(priv, is_high);
+        }
     }
+    spin_unlock(&priv->lock);
+    return HRTIMER_NORESTART;
 }
 
 //
@@ -416,33 +1166,58 @@ static void irq_handler_idle(struct tagtagtagear_data *priv) {
 // Decrement counter and stop motors if it reached zero.
 // Update position if it is known.
 //
-static void irq_handler_running(struct tagtagtagear_data *priv) {
+static void irq_handler_running(struct tagtagtagear_data *priv, ktime_t now) {
+    ktime_t last_hole_time = priv->state.running.last_hole_time;
+    if (priv->state.running.settling) {
+        // Inertia carried the ear to the next hole.
+        if (priv->state.running.position != -1) {
+            priv->state.running.position = position_add(priv->state.running.position, priv->state.running.direction);
+        }
+        if (priv->state.running.count > 0) {
+            priv->state.running.count--;
+        } else if (priv->state.running.overshoot < NUM_HOLES) {
+            priv->state.running.overshoot++;
+        }
+        start_settling(priv);
+        return;
+    }
     if (priv->state.running.position != -1) {
         priv->state.running.position = position_add(priv->state.running.position, priv->state.running.direction);
     }
     priv->state.running.count--;
+    if (last_hole_time != 0 && !priv->state.running.coasting && (priv->state.running.count > 0 || !approach_differs(priv))) {
+        unsigned long delta = (unsigned long) ktime_us_delta(now, last_hole_time);
+        int is_gap = delta > priv->detect_boundary_us;
+        int gap_end = gap_end_position(priv->state.running.direction);
+        if (is_gap && priv->state.running.position != gap_end) {
+            resync_position(priv, gap_end);
+        } else if (!is_gap && priv->state.running.position == gap_end) {
+            priv->state.running.unsure = 1;
+        }
+        update_hole_period(priv, delta, is_gap);
+    }
+    priv->state.running.last_hole_time = now;
     if (priv->state.running.count == 0) {
-        int is_high;
-        del_timer_sync(&priv->broken_timer);
+        if (priv->state.running.stop_armed) {
+            hrtimer_try_to_cancel(&priv->stop_timer);
+            priv->state.running.stop_armed = 0;
+            priv->state.running.coasting = 0;
+        }
+        stop_broken_timer(priv);
         stop_motors(priv);
-        is_high = gpiod_get_value(priv->encoder_gpio);
-        if (is_high) {
-            // Move backward.
-            priv->state.running.count = 1;
+        start_settling(priv);
+    } else {
+        if (priv->state.running.count == 1 && approach_differs(priv)) {
+            // Slow down for last hole.
             if (priv->state.running.direction > 0) {
-                priv->state.running.direction = -1;
-                priv->state.running.position = position_add(priv->state.running.position, 1);
-                start_motors_backward(priv);
+                start_motors_forward(priv);
             } else {
-                priv->state.running.direction = 1;
-                priv->state.running.position = position_add(priv->state.running.position, -1);
                 start_motors_backward(priv);
             }
-            reset_broken_timer(priv);
-        } else {
-            transition_to_idle(priv, priv->state.running.position);
         }
-    } else {
+        if (priv->state.running.count == 1 && last_hole_time != 0) {
+            arm_early_stop(priv, ktime_us_delta(now, last_hole_time));
+        }
         reset_broken_timer(priv);
     }
 }
@@ -452,8 +1227,7 @@ static void irq_handler_running(struct tagtagtagear_data *priv) {
 //
 // If elapsed time is greater than detect_boundary_us, we found the gap.
 //
-static void irq_handler_detecting(struct tagtagtagear_data *priv) {
-    ktime_t now = ktime_get_raw();
+static void irq_handler_detecting(struct tagtagtagear_data *priv, ktime_t now) {
     if (priv->state.detecting.last_hole_time == 0) {
         // We were between two holes.
         // Synchronize on the next hole in forward direction:
@@ -461,43 +1235,31 @@ static void irq_handler_detecting(struct tagtagtagear_data *priv) {
         if (priv->state.detecting.direction < 0) {
             priv->state.detecting.holes_count++;
         }
-        priv->state.detecting.last_hole_time = ktime_get_raw();
+        priv->state.detecting.last_hole_time = now;
         reset_broken_timer(priv);
     } else {
         unsigned long delta = (unsigned long) ktime_us_delta(now, priv->state.detecting.last_hole_time);
+        int is_gap = delta > priv->detect_boundary_us;
         priv->state.detecting.holes_count++;
-        if (delta > priv->detect_boundary_us) {
+        // The first interval from a hole includes acceleration from standstill.
+        if (!priv->state.detecting.from_standstill) {
+            update_hole_period(priv, delta, is_gap);
+        }
+        priv->state.detecting.from_standstill = 0;
+        if (is_gap) {
             // Found gap.
-            // We are at -EARS_OFFZERO.
-            int running_delta;
+            // We are at -EARS_OFFZERO going forward, at -EARS_OFFZERO - 1
+            // going backward.
+            int gap_end = gap_end_position(priv->state.detecting.direction);
+            int target;
             if (priv->state.detecting.post_state == read_position) {
                 // We moved priv->state.detecting.holes_count steps before reaching -EARS_OFFZERO
-                // Previous position (x) was such: x + priv->state.detecting.holes_count = NUM_HOLES-EARS_OFFZERO
-                // x = NUM_HOLES - priv->state.detecting.holes_count - EARS_OFFZERO
-                int previous_position = NUM_HOLES - priv->state.detecting.holes_count - EARS_OFFZERO;
-                if (previous_position < 0) {
-                    previous_position += NUM_HOLES;
-                }
-                priv->read_result_available = 1;
-                priv->read_result = previous_position;
-                wake_up_interruptible(&priv->read_wq);
-                // To reach previous position, we need to move further previous_position + EARS_OFFZERO
-                running_delta = position_add(previous_position, EARS_OFFZERO);
+                target = detected_previous_position(priv->state.detecting.holes_count);
+                push_event(priv, EAR_EVENT_POSITION, target);
             } else {
-                // To reach new_position, we need to move further new_position + EARS_OFFZERO
-                running_delta = position_add(priv->state.detecting.new_position, EARS_OFFZERO);
-                if (priv->state.detecting.direction < 0) {
-                    running_delta -= NUM_HOLES;
-                }
-            }
-            // Minimize movement.
-            while (running_delta > 9) {
-                running_delta -= NUM_HOLES;
+                target = priv->state.detecting.new_position;
             }
-            while (running_delta < -9) {
-                running_delta += NUM_HOLES;
-            }
-            transition_to_running(priv, NUM_HOLES - EARS_OFFZERO, running_delta);
+            transition_to_running(priv, gap_end, minimize_delta(position_add(target, -gap_end)));
         } else {
             priv->state.detecting.last_hole_time = now;
             reset_broken_timer(priv);
@@ -505,29 +1267,91 @@ static void irq_handler_detecting(struct tagtagtagear_data *priv) {
     }
 }
 
-static irqreturn_t tagtagtagear_irq_handler(int irq, void *dev_id) {
-    struct tagtagtagear_data *priv = dev_id;
+static void handle_edge(struct tagtagtagear_data *priv, ktime_t edge_time) {
     switch (priv->state_e) {
         case testing:
-            irq_handler_testing(priv);
+            irq_handler_testing(priv, edge_time);
             break;
 
         case idle:
-            irq_handler_idle(priv);
+            irq_handler_idle(priv, edge_time);
             break;
 
         case running:
-            irq_handler_running(priv);
+            irq_handler_running(priv, edge_time);
             break;
 
         case detecting:
-            irq_handler_detecting(priv);
+            irq_handler_detecting(priv, edge_time);
             break;
 
         default:
             // Do nothing.
             break;
     }
+}
+
+// Top half only timestamps the edge, first thing, so timings do not depend on
+// handling. edges is only written here and only read by the threaded handler,
+// so it needs no lock.
+static irqreturn_t tagtagtagear_irq_handler(int irq, void *dev_id) {
+    struct tagtagtagear_data *priv = dev_id;
+    ktime_t now = ktime_get_raw();
+    WRITE_ONCE(priv->edges_timestamped, true);
+    if (!kfifo_put(&priv->edges, now)) {
+        WRITE_ONCE(priv->edges_lost, true);
+    }
+    return IRQ_WAKE_THREAD;
+}
+
+// Some edges were not handled: hole count is wrong. Hole intervals are wrong
+// too, so the test turn and detection start over.
+static void lost_edges(struct tagtagtagear_data *priv) {
+    dev_warn_ratelimited(priv->device, "encoder edges were lost");
+    switch (priv->state_e) {
+        case testing:
+            transition_to_testing(priv);
+            break;
+
+        case detecting:
+            transition_to_detecting(priv, priv->state.detecting.post_state, priv->state.detecting.direction, priv->state.detecting.new_position);
+            break;
+
+        case idle:
+            priv->state.idle.position = -1;
+            priv->state.idle.tracked = -1;
+            priv->state.idle.direction = 0;
+            priv->state.idle.moved_from = -1;
+            break;
+
+        case running:
+            priv->state.running.position = -1;
+            break;
+
+        default:
+            break;
+    }
+}
+
+// Threaded handler runs the state machine for each timestamped edge.
+// If the encoder GPIO controller has nested interrupts, the top half is not
+// called and the edge is timestamped here.
+static irqreturn_t tagtagtagear_irq_thread(int irq, void *dev_id) {
+    struct tagtagtagear_data *priv = dev_id;
+    ktime_t edge_time;
+    spin_lock_bh(&priv->lock);
+    if (!READ_ONCE(priv->edges_timestamped)) {
+        handle_edge(priv, ktime_get_raw());
+    }
+    while (kfifo_get(&priv->edges, &edge_time)) {
+        handle_edge(priv, edge_time);
+    }
+    if (READ_ONCE(priv->edges_lost)) {
+        WRITE_ONCE(priv->edges_lost, false);
+        lost_edges(priv);
+    }
+    run_queue(priv);
+    spin_unlock_bh(&priv->lock);
     return IRQ_HANDLED;
 }
 
@@ -537,17 +1361,21 @@ static irqreturn_t tagtagtagear_irq_handler(int irq, void *dev_id) {
 
 // Protocol:
 // 1. Can only be opened once
-// 2. Writing is blocking/non-blocking depending on the state:
-// - in idle mode, writing is non blocking, command is executed and ear might
-//   transition to running/detecting
-// - in testing/running/detecting mode, writing is blocked until ear is in
-//   idle/broken mode.
-// - in broken mode, writing fails.
-// 3. Reading is blocking until a value is to be read.
+// 2. A single write can contain any number of commands. Commands are queued
+// and executed in order, as soon as the ear is idle:
+// - writing is non blocking unless the queue is full (queue_depth module
+//   parameter), in which case writing is blocked until a command is executed.
+//   Poll reports the device as writable when the queue has room.
+// - in broken mode, writing fails and queued commands are discarded.
+// 3. Reading is blocking until a value is to be read, also while the ear is
+//    broken, as it is tested again (see retest_interval).
+// 4. If device was opened with O_NONBLOCK, operations that would block fail
+//    with EAGAIN instead. A write returns the number of bytes processed before
+//    it would have blocked.
 
 // NOP command
 // Command = '.'
-// Blocks until ear is in idle mode.
+// Blocks until previous commands were executed and ear is in idle mode.
 // $ echo -n -e '.' > /dev/ear0
 
 // Turn forward command
@@ -592,29 +1420,56 @@ static irqreturn_t tagtagtagear_irq_handler(int irq, void *dev_id) {
 // Next read byte is 0-16 (position).
 // $ echo -n -e '!' > /dev/ear0 && dd if=/dev/ear0 of=/dev/stdout count=1 bs=1 status=none | hexdump -e '/1 "%d\n"'
 
-// When a get current position command finishes, read returns -1 or 0-16.
-// Otherwise, reading blocks until ear is moved by user. Then it returns 'm'.
-// Any move operation clears the "moved flag". When this flag is cleared, driver
-// returns the last known position (before/after move depending on when read
-// is performed).
-
-// Get position commands also overwrite this "moved flag".
+// Schedule next command
+// Command = '@'
+// Parameter = T (8 bytes, little endian)
+// Next command is not started before T, a CLOCK_MONOTONIC time in nanoseconds.
+// Following commands are executed after it, in order.
+// $ echo -n -e '@\x00\xd0\xed\x90\x2e\x00\x00\x00+\x03' > /dev/ear0
+
+// Play an animation
+// Command = 'a'
+// Parameter = N (single byte), followed by N keyframes of 4 bytes:
+// - time offset in milliseconds (2 bytes, little endian), relative to the
+//   start of the animation
+// - direction ('>' or '<')
+// - position
+// Keyframes are queued as '>' or '<' commands and the driver plays them on its
+// own: each one starts at its offset, or as soon as the previous one completed
+// if it is late. Animation starts when 'a' is executed (or at the time given
+// by a preceding '@' command).
+// $ echo -n -e 'a\x02\x00\x00>\x0A\xe8\x03<\x00' > /dev/ear0
+
+// Enable event mode
+// Command = 'e'
+// Executed immediately, not queued. Until the device is closed, read returns
+// struct ear_event records (see tagtagtag-ears.h) instead of bytes.
+// In event mode, every command also produces an EAR_EVENT_DONE record when it
+// completes, with its final position and how it got there.
+
+// Reading returns events in the order they occurred:
+// - when a get current position command finishes, read returns -1 or 0-16.
+// - when ear breaks, read returns 'b', and 'r' once it passed a test again.
+// - when ear is moved by user, read returns 'm'. No further 'm' is returned
+//   until this one is read.
+// Reading blocks until an event is available. Up to EVENT_QUEUE_DEPTH events
+// are kept, older events are dropped.
+// Every queued command gets a sequence number, starting from 1 when device is
+// opened, reported in events of event mode. Events not read by the previous
+// client are discarded on open.
 
 static void move_forward(struct tagtagtagear_data *priv, unsigned char arg) {
     int position = get_idle_position(priv);
-    priv->read_result = position;
     transition_to_running(priv, position, arg);
 }
 
 static void move_backward(struct tagtagtagear_data *priv, unsigned char arg) {
     int position = get_idle_position(priv);
-    priv->read_result = position;
     transition_to_running(priv, position, -arg);
 }
 
 static void goto_forward(struct tagtagtagear_data *priv, unsigned char arg) {
     int position = get_idle_position(priv);
-    priv->read_result = position;
     if (position == -1) {
         transition_to_detecting(priv, goto_position, 1, arg);
     } else {
@@ -629,7 +1484,6 @@ static void goto_forward(struct tagtagtagear_data *priv, unsigned char arg) {
 
 static void goto_backward(struct tagtagtagear_data *priv, unsigned char arg) {
     int position = get_idle_position(priv);
-    priv->read_result = position;
     if (position == -1) {
         transition_to_detecting(priv, goto_position, -1, arg);
     } else {
@@ -647,14 +1501,10 @@ static void get_position(struct tagtagtagear_data *priv, int run_detection) {
         if (run_detection) {
             transition_to_detecting(priv, read_position, 1, 0);
         } else {
-            priv->read_result_available = 1;
-            priv->read_result = -1;
-            wake_up_interruptible(&priv->read_wq);
+            push_event(priv, EAR_EVENT_POSITION, -1);
         }
     } else {
-        priv->read_result_available = 1;
-        priv->read_result = priv->state.idle.position;
-        wake_up_interruptible(&priv->read_wq);
+        push_event(priv, EAR_EVENT_POSITION, position);
     }
 }
 
@@ -663,117 +1513,357 @@ static int ear_open(struct inode *inode, struct file *file) {
     ear_data = container_of(inode->i_cdev, struct tagtagtagear_data, cdev);
     file->private_data = ear_data;
 
-    if (ear_data->opened) {
+    if (test_and_set_bit(0, &ear_data->opened)) {
         return -EBUSY;
     }
-    ear_data->opened = 1;
+    ear_data->event_mode = 0;
+    // A start time or keyframe written by the previous client must not apply
+    // to the next command.
+    ear_data->buffer_size = 0;
+    ear_data->keyframes_left = 0;
+    ear_data->pending_start = 0;
+    ear_data->pending_relative = 0;
+    // Events of the previous client would collide with new sequence numbers.
+    spin_lock_bh(&ear_data->lock);
+    kfifo_reset(&ear_data->events);
+    ear_data->moved_pending = 0;
+    ear_data->next_sequence = 0;
+    // A new client is told the ear is broken, as the previous one was.
+    if (ear_data->state_e == broken) {
+        push_event(ear_data, EAR_EVENT_BROKEN, -1);
+    }
+    spin_unlock_bh(&ear_data->lock);
     return 0;
 }
 
 static int ear_release(struct inode *inode, struct file *file) {
     struct tagtagtagear_data *ear_data;
     ear_data = container_of(inode->i_cdev, struct tagtagtagear_data, cdev);
-    ear_data->opened = 0;
+    clear_bit(0, &ear_data->opened);
     return 0;
 }
 
-static ssize_t ear_read(struct file *file, char __user *buffer, size_t len, loff_t *offset) {
+// Dequeue up to count events.
+static unsigned int pop_events(struct tagtagtagear_data *priv, struct ear_event *events, unsigned int count) {
+    unsigned int ix;
+    spin_lock_bh(&priv->lock);
+    for (ix = 0; ix < count && kfifo_get(&priv->events, &events[ix]); ix++) {
+        if (events[ix].type == EAR_EVENT_MOVED) {
+            priv->moved_pending = 0;
+        }
+    }
+    spin_unlock_bh(&priv->lock);
+    return ix;
+}
+
+static ssize_t ear_read(struct file *file, char __user *buffer, size_t len, loff_t *offset) {
     struct tagtagtagear_data *priv = (struct tagtagtagear_data *) file->private_data;
-    if (priv->state_e == broken) {
-        return 0;
+    struct ear_event events[8];
+    size_t event_size = priv->event_mode ? sizeof(struct ear_event) : 1;
+    ssize_t result = 0;
+    if (len < event_size) {
+        return priv->event_mode ? -EINVAL : 0;
+    }
+    if (kfifo_is_empty(&priv->events) && (file->f_flags & O_NONBLOCK)) {
+        return -EAGAIN;
     }
-    if (wait_event_interruptible(priv->read_wq, priv->read_result_available != 0)) {
+    if (wait_event_interruptible(priv->read_wq, !kfifo_is_empty(&priv->events))) {
         return -ERESTARTSYS;
     }
-    if (len <= 0) {
-        return 0;
+    while (len - result >= event_size) {
+        unsigned int count = pop_events(priv, events, min_t(size_t, ARRAY_SIZE(events), (len - result) / event_size));
+        unsigned int ix;
+        if (count == 0) {
+            break;
+        }
+        if (priv->event_mode) {
+            if (copy_to_user(buffer + result, events, count * event_size)) {
+                return -EFAULT;
+            }
+        } else {
+            for (ix = 0; ix < count; ix++) {
+                char value = events[ix].type == EAR_EVENT_POSITION ? events[ix].position : events[ix].type;
+                if (copy_to_user(buffer + result + ix, &value, 1)) {
+                    return -EFAULT;
+                }
+            }
+        }
+        result += count * event_size;
     }
-    if (priv->read_result_available) {
-        if (copy_to_user(buffer, &priv->read_result, 1)) {
-            return -EFAULT;
+    return result;
+}
+
+static void execute_command(struct tagtagtagear_data *priv, struct ear_command *cmd) {
+    priv->sequence = cmd->sequence;
+    priv->command = cmd->command;
+    priv->command_flags = 0;
+    priv->command_start_ns = ktime_get_ns();
+    priv->motors_on_us = 0;
+    priv->corrections = 0;
+    switch (cmd->command) {
+        case '+':
+            move_forward(priv, cmd->arg);
+            break;
+
+        case '-':
+            move_backward(priv, cmd->arg);
+            break;
+
+        case '>':
+            goto_forward(priv, cmd->arg);
+            break;
+
+        case '<':
+            goto_backward(priv, cmd->arg);
+            break;
+
+        case '?':
+            get_position(priv, 0);
+            break;
+
+        case '!':
+            get_position(priv, 1);
+            break;
+
+        case 'a':
+            priv->animation_start = cmd->start ? cmd->start : ktime_get();
+            break;
+    }
+    // Commands that did not move the ear are already completed.
+    if (priv->state_e == idle) {
+        complete_command(priv, priv->state.idle.position);
+    }
+}
+
+//
+// Execute queued commands while ear is idle.
+// Called with lock held, from write and whenever the state machine may have
+// returned to idle (IRQ handler and timers).
+// If next command is scheduled later, arm start timer.
+//
+static void run_queue(struct tagtagtagear_data *priv) {
+    struct ear_command cmd;
+    int dequeued = 0;
+    while (priv->state_e == idle && !priv->reserved && kfifo_peek(&priv->commands, &cmd)) {
+        if (cmd.relative) {
+            cmd.start = ktime_add(priv->animation_start, cmd.start);
         }
-        priv->read_result_available = 0;
-        return 1;
+        if (cmd.start && ktime_after(cmd.start, ktime_get())) {
+            hrtimer_start(&priv->start_timer, cmd.start, HRTIMER_MODE_ABS_SOFT);
+            break;
+        }
+        kfifo_skip(&priv->commands);
+        execute_command(priv, &cmd);
+        dequeued = 1;
+    }
+    if (dequeued) {
+        wake_up(&priv->write_wq);
     }
-    return 0;
 }
 
-static ssize_t ear_write(struct file *file, const char __user *buffer, size_t len, loff_t *offset) {
-    struct tagtagtagear_data *priv = (struct tagtagtagear_data *) file->private_data;
-    if (wait_event_interruptible(priv->write_wq, priv->state_e == broken || priv->state_e == idle)) {
-        return -ERESTARTSYS;
+static enum hrtimer_restart tagtagtagear_start_timer_cb(struct hrtimer *t) {
+    struct tagtagtagear_data *priv = container_of(t, struct tagtagtagear_data, start_timer);
+    spin_lock(&priv->lock);
+    run_queue(priv);
+    spin_unlock(&priv->lock);
+    return HRTIMER_NORESTART;
+}
+
+static int is_drained(struct tagtagtagear_data *priv) {
+    return priv->state_e == broken || (priv->state_e == idle && !priv->reserved && kfifo_is_empty(&priv->commands));
+}
+
+// With fast start, ears are not tested on start-up. If calibration was not
+// restored by the time a command is sent, test them now: the command is
+// executed once the test is over. Called with lock held.
+static void test_if_uncalibrated(struct tagtagtagear_data *priv) {
+    if (priv->state_e == idle && priv->detect_boundary_us == 0) {
+        transition_to_testing(priv);
     }
-    if (len <= 0) {
-        return 0;
+}
+
+static int queue_command(struct tagtagtagear_data *priv, char command, unsigned char arg, int nonblock) {
+    struct ear_command cmd = { .command = command, .arg = arg };
+    spin_lock_bh(&priv->lock);
+    // Check again once locked: another writer sharing the file may have
+    // filled the queue after we were woken up.
+    while (priv->state_e != broken && kfifo_is_full(&priv->commands)) {
+        spin_unlock_bh(&priv->lock);
+        if (nonblock) {
+            return -EAGAIN;
+        }
+        if (wait_event_interruptible(priv->write_wq, priv->state_e == broken || !kfifo_is_full(&priv->commands))) {
+            return -ERESTARTSYS;
+        }
+        spin_lock_bh(&priv->lock);
     }
     if (priv->state_e == broken) {
+        spin_unlock_bh(&priv->lock);
         return -EFAULT;
     }
-    if (priv->state_e == idle) {
-        // I need 1 or 2 bytes.
-        char kbuffer[2];
-        int kbuffer_size = 0;
-        int read = 0;
-        if (priv->buffer_size > 0) {
-            // Just missing parameter
-            kbuffer[0] = priv->buffer[0];
-            if (copy_from_user(kbuffer + 1, buffer, 1)) {
-                return -EFAULT;
+    test_if_uncalibrated(priv);
+    cmd.sequence = ++priv->next_sequence;
+    cmd.start = priv->pending_start;
+    cmd.relative = priv->pending_relative;
+    priv->pending_start = 0;
+    priv->pending_relative = 0;
+    kfifo_put(&priv->commands, cmd);
+    run_queue(priv);
+    spin_unlock_bh(&priv->lock);
+    return 0;
+}
+
+// Number of bytes of a command, including the command byte, when each move
+// command takes args parameters.
+static unsigned int command_length(char c, unsigned int args) {
+    switch (c) {
+        case '@':
+            return 1 + sizeof(u64);
+
+        case 'a':
+            return 2;
+
+        case '+':
+        case '-':
+        case '>':
+        case '<':
+            return 1 + args;
+
+        default:
+            return 1;
+    }
+}
+
+// Decode start time of '@' command (little endian).
+static ktime_t decode_start_time(const char *buffer) {
+    u64 start_ns = 0;
+    int ix;
+    for (ix = sizeof(u64) - 1; ix >= 0; ix--) {
+        start_ns = (start_ns << 8) | (unsigned char) buffer[ix];
+    }
+    return ns_to_ktime(start_ns);
+}
+
+// Process a complete command written to the device.
+static int write_command(struct tagtagtagear_data *priv, int nonblock) {
+    int err = 0;
+    switch (priv->buffer[0]) {
+        case '.':
+            if (nonblock && !is_drained(priv)) {
+                return -EAGAIN;
             }
-            kbuffer_size = 2;
-            read = 1;
-        } else {
-            if (copy_from_user(kbuffer, buffer, 1)) {
-                return -EFAULT;
+            if (wait_event_interruptible(priv->write_wq, is_drained(priv))) {
+                return -ERESTARTSYS;
             }
-            read = 1;
-            if (kbuffer[0] == '+' || kbuffer[0] == '-' || kbuffer[0] == '>' || kbuffer[0] == '<') {
-                if (len == 1) {
-                    priv->buffer_size = 1;
-                    priv->buffer[0] = kbuffer[0];
-                    *offset += 1;
-                    return 1;
-                }
-                if (copy_from_user(kbuffer + 1, buffer + 1, 1)) {
-                    return -EFAULT;
-                }
-                read = 2;
+            if (priv->state_e == broken) {
+                return -EFAULT;
             }
-        }
-        priv->buffer_size = 0;
-        switch (kbuffer[0]) {
-            case '.':
-                // NOP.
-                break;
+            break;
 
-            case '+':
-                move_forward(priv, (unsigned char) kbuffer[1]);
-                break;
+        case '@':
+            priv->pending_start = decode_start_time(priv->buffer + 1);
+            break;
 
-            case '-':
-                move_backward(priv, (unsigned char) kbuffer[1]);
-                break;
+        case '+':
+        case '-':
+        case '>':
+        case '<':
+            err = queue_command(priv, priv->buffer[0], (unsigned char) priv->buffer[1], nonblock);
+            break;
 
-            case '>':
-                goto_forward(priv, (unsigned char) kbuffer[1]);
-                break;
+        case '?':
+        case '!':
+            err = queue_command(priv, priv->buffer[0], 0, nonblock);
+            break;
 
-            case '<':
-                goto_backward(priv, (unsigned char) kbuffer[1]);
-                break;
+        case 'e':
+            priv->event_mode = 1;
+            break;
 
-            case '?':
-                get_position(priv, 0);
-                break;
+        case 'a':
+            err = queue_command(priv, 'a', 0, nonblock);
+            if (err == 0) {
+                priv->keyframes_left = (unsigned char) priv->buffer[1];
+            }
+            break;
+    }
+    return err;
+}
+
+// Process a complete keyframe written to the device.
+// Keyframes with an invalid direction are ignored.
+static int write_keyframe(struct tagtagtagear_data *priv, int nonblock) {
+    unsigned int offset_ms = (unsigned char) priv->buffer[0] | ((unsigned char) priv->buffer[1] << 8);
+    char direction = priv->buffer[2];
+    int err = 0;
+    if (direction == '>' || direction == '<') {
+        priv->pending_start = ms_to_ktime(offset_ms);
+        priv->pending_relative = 1;
+        err = queue_command(priv, direction, (unsigned char) priv->buffer[3], nonblock);
+        if (err) {
+            priv->pending_start = 0;
+            priv->pending_relative = 0;
+        }
+    }
+    if (err == 0) {
+        priv->keyframes_left--;
+    }
+    return err;
+}
 
-            case '!':
-                get_position(priv, 1);
+// Process a single byte written to the device.
+// If processing fails, byte is not consumed.
+static int write_byte(struct tagtagtagear_data *priv, char c, int nonblock) {
+    int err;
+    if (priv->state_e == broken) {
+        return -EFAULT;
+    }
+    priv->buffer[priv->buffer_size++] = c;
+    if (priv->keyframes_left > 0) {
+        if (priv->buffer_size < KEYFRAME_SIZE) {
+            return 0;
+        }
+        err = write_keyframe(priv, nonblock);
+    } else {
+        if (priv->buffer_size < command_length(priv->buffer[0], 1)) {
+            // Missing parameters
+            return 0;
+        }
+        err = write_command(priv, nonblock);
+    }
+    if (err) {
+        priv->buffer_size--;
+    } else {
+        priv->buffer_size = 0;
+    }
+    return err;
+}
+
+static ssize_t ear_write(struct file *file, const char __user *buffer, size_t len, loff_t *offset) {
+    struct tagtagtagear_data *priv = (struct tagtagtagear_data *) file->private_data;
+    char kbuffer[32];
+    size_t written = 0;
+    int err = 0;
+    while (written < len && err == 0) {
+        size_t chunk = min(len - written, sizeof(kbuffer));
+        size_t ix;
+        if (copy_from_user(kbuffer, buffer + written, chunk)) {
+            err = -EFAULT;
+            break;
+        }
+        for (ix = 0; ix < chunk; ix++) {
+            err = write_byte(priv, kbuffer[ix], file->f_flags & O_NONBLOCK);
+            if (err) {
                 break;
+            }
+            written++;
         }
-        *offset += read;
-        return read;
     }
-    return 0;
+    if (written == 0) {
+        return err;
+    }
+    *offset += written;
+    return written;
 }
 
 static unsigned int ear_poll(struct file *file, poll_table *wait) {
@@ -783,15 +1873,12 @@ static unsigned int ear_poll(struct file *file, poll_table *wait) {
     poll_wait(file, &priv->write_wq,  wait);
     poll_wait(file, &priv->read_wq, wait);
 
-    if (priv->state_e == broken) {
-        mask |= POLLHUP;
-    } else {
-        if (priv->state_e == idle) {
-            mask |= POLLOUT | POLLWRNORM;
-        }
-        if (priv->read_result_available != 0) {
-            mask |= POLLIN | POLLRDNORM;
-        }
+    // A broken ear is not writable until it recovers, which readers are told.
+    if (priv->state_e != broken && !kfifo_is_full(&priv->commands)) {
+        mask |= POLLOUT | POLLWRNORM;
+    }
+    if (!kfifo_is_empty(&priv->events)) {
+        mask |= POLLIN | POLLRDNORM;
     }
     return mask;
 }
@@ -805,12 +1892,463 @@ static struct file_operations ear_fops = {
     .poll = ear_poll,
 };
 
+// ========================================================================== //
+// Combined device
+// ========================================================================== //
+
+// /dev/ears drives both ears with a single command, starting both motor pairs
+// at the same instant. Commands are written with one parameter per ear:
+// - '.': block until both ears executed previous commands and are idle.
+// - '+' L R, '-' L R, '>' L R, '<' L R: same as /dev/ear*, left ear with L
+//   and right ear with R.
+// - '@' T: schedule next command at T, as on /dev/ear*.
+// A command is only started when both ears are idle and have no queued
+// command. A scheduled command is then started by a timer, while ears do not
+// execute commands queued on /dev/ear*.
+// Reading is not supported: events are reported on /dev/ear*.
+
+static int ears_drained(struct tagtagtagears_data *priv) {
+    return is_drained(&priv->ear[0]) && is_drained(&priv->ear[1]);
+}
+
+static int ears_broken(struct tagtagtagears_data *priv) {
+    return priv->ear[0].state_e == broken || priv->ear[1].state_e == broken;
+}
+
+static int wait_ears_drained(struct tagtagtagears_data *priv, int nonblock) {
+    int ix;
+    for (ix = 0; ix < 2; ix++) {
+        if (nonblock && !is_drained(&priv->ear[ix])) {
+            return -EAGAIN;
+        }
+        if (wait_event_interruptible(priv->ear[ix].write_wq, is_drained(&priv->ear[ix]))) {
+            return -ERESTARTSYS;
+        }
+    }
+    return ears_broken(priv) ? -EFAULT : 0;
+}
+
+// Set the four motor GPIOs at once from values computed by both ears.
+// If motors are driven by PWMs, set them one ear after the other.
+static void apply_motors(struct tagtagtagears_data *priv) {
+    int ix;
+    if (priv->motor_descs[0] == NULL) {
+        write_motors(&priv->ear[0]);
+        write_motors(&priv->ear[1]);
+        return;
+    }
+    {
+#if LINUX_VERSION_CODE >= KERNEL_VERSION(5, 0, 0)
+    unsigned long values = 0;
+    for (ix = 0; ix < 4; ix++) {
+        if (priv->ear[ix >> 1].motor_values[ix & 1]) {
+            values |= BIT(ix);
+        }
+    }
+    gpiod_set_array_value(4, priv->motor_descs, NULL, &values);
+#else
+    int values[4];
+    for (ix = 0; ix < 4; ix++) {
+        values[ix] = priv->ear[ix >> 1].motor_values[ix & 1];
+    }
+    gpiod_set_array_value(4, priv->motor_descs, values);
+#endif
+    }
+}
+
+// Execute command on both ears, with both locks held.
+static void run_ears_command(struct tagtagtagears_data *priv, char command, unsigned char args[2]) {
+    int ix;
+    for (ix = 0; ix < 2; ix++) {
+        struct ear_command cmd = { .command = command, .arg = args[ix] };
+        cmd.sequence = ++priv->ear[ix].next_sequence;
+        priv->ear[ix].motors_deferred = 1;
+        execute_command(&priv->ear[ix], &cmd);
+        priv->ear[ix].motors_deferred = 0;
+    }
+    apply_motors(priv);
+}
+
+static enum hrtimer_restart tagtagtagears_sync_timer_cb(struct hrtimer *t) {
+    struct tagtagtagears_data *priv = container_of(t, struct tagtagtagears_data, sync_timer);
+    int ix;
+    spin_lock(&priv->ear[0].lock);
+    spin_lock(&priv->ear[1].lock);
+    priv->ear[0].reserved = 0;
+    priv->ear[1].reserved = 0;
+    if (!ears_broken(priv)) {
+        run_ears_command(priv, priv->sync_command, priv->sync_args);
+    }
+    for (ix = 0; ix < 2; ix++) {
+        run_queue(&priv->ear[ix]);
+        wake_up(&priv->ear[ix].write_wq);
+    }
+    spin_unlock(&priv->ear[1].lock);
+    spin_unlock(&priv->ear[0].lock);
+    return HRTIMER_NORESTART;
+}
+
+static int execute_ears_command(struct tagtagtagears_data *priv, char command, unsigned char args[2], int nonblock) {
+    int err;
+    int ix;
+    for (ix = 0; ix < 2; ix++) {
+        spin_lock_bh(&priv->ear[ix].lock);
+        test_if_uncalibrated(&priv->ear[ix]);
+        spin_unlock_bh(&priv->ear[ix].lock);
+    }
+    while (1) {
+        err = wait_ears_drained(priv, nonblock);
+        if (err) {
+            return err;
+        }
+        // Always lock left ear first.
+        spin_lock_bh(&priv->ear[0].lock);
+        spin_lock(&priv->ear[1].lock);
+        if (ears_drained(priv)) {
+            break;
+        }
+        // A command was queued on /dev/ear* meanwhile.
+        spin_unlock(&priv->ear[1].lock);
+        spin_unlock_bh(&priv->ear[0].lock);
+    }
+    if (ears_broken(priv)) {
+        err = -EFAULT;
+    } else if (priv->pending_start && ktime_after(priv->pending_start, ktime_get())) {
+        priv->ear[0].reserved = 1;
+        priv->ear[1].reserved = 1;
+        priv->sync_command = command;
+        priv->sync_args[0] = args[0];
+        priv->sync_args[1] = args[1];
+        hrtimer_start(&priv->sync_timer, priv->pending_start, HRTIMER_MODE_ABS_SOFT);
+    } else {
+        run_ears_command(priv, command, args);
+    }
+    spin_unlock(&priv->ear[1].lock);
+    spin_unlock_bh(&priv->ear[0].lock);
+    if (err == 0) {
+        priv->pending_start = 0;
+    }
+    return err;
+}
+
+static int ears_open(struct inode *inode, struct file *file) {
+    struct tagtagtagears_data *ears_data;
+    ears_data = container_of(inode->i_cdev, struct tagtagtagears_data, cdev);
+    file->private_data = ears_data;
+
+    if (test_and_set_bit(0, &ears_data->opened)) {
+        return -EBUSY;
+    }
+    // A partial command or start time written by the previous client must not
+    // apply to the next command.
+    ears_data->buffer_size = 0;
+    ears_data->pending_start = 0;
+    return 0;
+}
+
+static int ears_release(struct inode *inode, struct file *file) {
+    struct tagtagtagears_data *ears_data;
+    ears_data = container_of(inode->i_cdev, struct tagtagtagears_data, cdev);
+    clear_bit(0, &ears_data->opened);
+    return 0;
+}
+
+// Process a complete command written to the combined device.
+static int ears_write_command(struct tagtagtagears_data *priv, int nonblock) {
+    unsigned char args[2];
+    switch (priv->buffer[0]) {
+        case '.':
+            return wait_ears_drained(priv, nonblock);
+
+        case '@':
+            priv->pending_start = decode_start_time(priv->buffer + 1);
+            break;
+
+        case '+':
+        case '-':
+        case '>':
+        case '<':
+            args[0] = priv->buffer[1];
+            args[1] = priv->buffer[2];
+            return execute_ears_command(priv, priv->buffer[0], args, nonblock);
+    }
+    return 0;
+}
+
+// Process a single byte written to the combined device.
+// If processing fails, byte is not consumed.
+static int ears_write_byte(struct tagtagtagears_data *priv, char c, int nonblock) {
+    int err;
+    if (ears_broken(priv)) {
+        return -EFAULT;
+    }
+    priv->buffer[priv->buffer_size++] = c;
+    if (priv->buffer_size < command_length(priv->buffer[0], 2)) {
+        // Missing parameters
+        return 0;
+    }
+    err = ears_write_command(priv, nonblock);
+    if (err) {
+        priv->buffer_size--;
+    } else {
+        priv->buffer_size = 0;
+    }
+    return err;
+}
+
+static ssize_t ears_write(struct file *file, const char __user *buffer, size_t len, loff_t *offset) {
+    struct tagtagtagears_data *priv = (struct tagtagtagears_data *) file->private_data;
+    char kbuffer[32];
+    size_t written = 0;
+    int err = 0;
+    while (written < len && err == 0) {
+        size_t chunk = min(len - written, sizeof(kbuffer));
+        size_t ix;
+        if (copy_from_user(kbuffer, buffer + written, chunk)) {
+            err = -EFAULT;
+            break;
+        }
+        for (ix = 0; ix < chunk; ix++) {
+            err = ears_write_byte(priv, kbuffer[ix], file->f_flags & O_NONBLOCK);
+            if (err) {
+                break;
+            }
+            written++;
+        }
+    }
+    if (written == 0) {
+        return err;
+    }
+    *offset += written;
+    return written;
+}
+
+static unsigned int ears_poll(struct file *file, poll_table *wait) {
+    struct tagtagtagears_data *priv = (struct tagtagtagears_data *) file->private_data;
+    unsigned int mask = 0;
+
+    poll_wait(file, &priv->ear[0].write_wq, wait);
+    poll_wait(file, &priv->ear[1].write_wq, wait);
+
+    if (!ears_broken(priv) && ears_drained(priv)) {
+        mask |= POLLOUT | POLLWRNORM;
+    }
+    return mask;
+}
+
+static struct file_operations ears_fops = {
+    .owner = THIS_MODULE,
+    .open = ears_open,
+    .write = ears_write,
+    .release = ears_release,
+    .poll = ears_poll,
+};
+
+// ========================================================================== //
+// Parking
+// ========================================================================== //
+
+// Move ear to park_position by the shortest path. Called with ear locked,
+// idle and with no queued command.
+static void park_ear(struct tagtagtagear_data *priv) {
+    int position = get_idle_position(priv);
+    if (position == -1) {
+        transition_to_detecting(priv, goto_position, 1, park_position);
+    } else {
+        transition_to_running(priv, position, minimize_delta(park_position - position));
+    }
+}
+
+static long park_remaining(unsigned long deadline) {
+    return time_before(jiffies, deadline) ? deadline - jiffies : 0;
+}
+
+// On shutdown and removal, drop queued commands, let current ones finish and
+// park ears, so their position is known on next start (see fast_start).
+// Motors are stopped if ears are not parked within PARK_TIMEOUT_MS.
+// write_wq is woken with wake_up(), so these uninterruptible waits see each
+// completed command.
+static void park_ears(struct tagtagtagears_data *priv) {
+    unsigned long deadline = jiffies + msecs_to_jiffies(PARK_TIMEOUT_MS);
+    struct tagtagtagear_data *ear;
+    int ix;
+
+    if (park_position < 0 || park_position >= NUM_HOLES) {
+        return;
+    }
+    hrtimer_cancel(&priv->sync_timer);
+    for (ix = 0; ix < 2; ix++) {
+        ear = &priv->ear[ix];
+        hrtimer_cancel(&ear->start_timer);
+        spin_lock_bh(&ear->lock);
+        kfifo_reset(&ear->commands);
+        ear->reserved = 0;
+        spin_unlock_bh(&ear->lock);
+    }
+    for (ix = 0; ix < 2; ix++) {
+        ear = &priv->ear[ix];
+        wait_event_timeout(ear->write_wq, is_drained(ear), park_remaining(deadline));
+        spin_lock_bh(&ear->lock);
+        if (ear->state_e == idle && ear->detect_boundary_us != 0) {
+            park_ear(ear);
+        }
+        spin_unlock_bh(&ear->lock);
+    }
+    for (ix = 0; ix < 2; ix++) {
+        ear = &priv->ear[ix];
+        wait_event_timeout(ear->write_wq, is_drained(ear), park_remaining(deadline));
+        spin_lock_bh(&ear->lock);
+        if (ear->state_e == idle) {
+            dev_info(ear->device, "parked at %d", get_idle_position(ear));
+        } else if (ear->state_e != broken) {
+            dev_warn(ear->device, "could not park ear in time");
+            stop_broken_timer(ear);
+            stop_motors(ear);
+        }
+        spin_unlock_bh(&ear->lock);
+    }
+}
+
+// ========================================================================== //
+// Sysfs
+// ========================================================================== //
+
+// calibration: "<hole period> <gap period> <stop lead> <position>", periods
+// in microseconds. Reading it before shutdown and writing it back after
+// start-up with fast_start avoids the test turn. Restored position is
+// checked on next gap crossing. Position is the current one even with
+// park_position set: userspace saves the park position itself if it wants it
+// restored.
+
+static ssize_t calibration_show(struct device *dev, struct device_attribute *attr, char *buf) {
+    struct tagtagtagear_data *priv = dev_get_drvdata(dev);
+    unsigned long hole_period_us, gap_period_us, stop_lead_us;
+    int position = -1;
+
+    spin_lock_bh(&priv->lock);
+    hole_period_us = priv->hole_period_us;
+    gap_period_us = priv->gap_period_us;
+    stop_lead_us = priv->stop_lead_us;
+    if (priv->state_e == idle && !encoder_is_high(priv)) {
+        // Reading must not change state: an ear found off its hole is
+        // reported as unknown, but only the next command marks it as moved.
+        position = priv->state.idle.position;
+    }
+    spin_unlock_bh(&priv->lock);
+
+    if (hole_period_us == 0) {
+        return -ENODATA;
+    }
+    return scnprintf(buf, PAGE_SIZE, "%lu %lu %lu %d\n", hole_period_us, gap_period_us, stop_lead_us, position);
+}
+
+static ssize_t calibration_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    struct tagtagtagear_data *priv = dev_get_drvdata(dev);
+    unsigned long hole_period_us, gap_period_us, stop_lead_us;
+    int position;
+    int err = 0;
+
+    if (sscanf(buf, "%lu %lu %lu %d", &hole_period_us, &gap_period_us, &stop_lead_us, &position) != 4) {
+        return -EINVAL;
+    }
+    if (hole_period_us == 0 || gap_period_us <= hole_period_us || stop_lead_us > hole_period_us / 2
+        || position < -1 || position >= NUM_HOLES) {
+        return -EINVAL;
+    }
+
+    spin_lock_bh(&priv->lock);
+    if (priv->state_e != idle || priv->command != 0 || !kfifo_is_empty(&priv->commands)) {
+        err = -EBUSY;
+    } else {
+        priv->hole_period_us = hole_period_us;
+        priv->gap_period_us = gap_period_us;
+        priv->detect_boundary_us = (hole_period_us + gap_period_us) >> 1;
+        priv->stop_lead_us = stop_lead_us;
+        if (encoder_is_high(priv)) {
+            // Ear is not on a hole, it was moved.
+            position = -1;
+        }
+        memset(&priv->state, 0, sizeof(priv->state));
+        priv->state.idle.position = position;
+        priv->state.idle.moved_from = position;
+        priv->state.idle.tracked = -1;
+    }
+    spin_unlock_bh(&priv->lock);
+
+    return err ? err : count;
+}
+
+static DEVICE_ATTR_RW(calibration);
+
+// retest: writing anything runs the start-up test again, to recover a broken
+// ear or recalibrate an idle one.
+static ssize_t retest_store(struct device *dev, struct device_attribute *attr, const char *buf, size_t count) {
+    struct tagtagtagear_data *priv = dev_get_drvdata(dev);
+    int err = 0;
+
+    spin_lock_bh(&priv->lock);
+    if (is_drained(priv)) {
+        hrtimer_try_to_cancel(&priv->retest_timer);
+        transition_to_testing(priv);
+    } else {
+        err = -EBUSY;
+    }
+    spin_unlock_bh(&priv->lock);
+
+    return err ? err : count;
+}
+
+static DEVICE_ATTR_WO(retest);
+
+static struct attribute *ear_attrs[] = {
+    &dev_attr_calibration.attr,
+    &dev_attr_retest.attr,
+    NULL,
+};
+
+ATTRIBUTE_GROUPS(ear);
+
 // ========================================================================== //
 // Probing, initialization and cleanup
 // ========================================================================== //
 
-static int init_ear(struct device *dev, struct tagtagtagear_data *priv, struct class *ears_class, int major, int minor, const char* encoder_name, const char* motor_name) {
+// Get forward and backward PWMs. Returns -ENODEV if motors are not driven by PWMs.
+static int init_motor_pwms(struct device *dev, struct tagtagtagear_data *priv, const char *const pwm_names[2]) {
+    int ix;
+    int err;
+
+    // Without pwms, devm_pwm_get fails with -EINVAL (no pwm-names) rather
+    // than -ENODEV.
+    if (!device_property_present(dev, "pwms"))
+        return -ENODEV;
+    for (ix = 0; ix < 2; ix++) {
+        priv->motor_pwms[ix] = devm_pwm_get(dev, pwm_names[ix]);
+        if (IS_ERR(priv->motor_pwms[ix])) {
+            err = PTR_ERR(priv->motor_pwms[ix]);
+            priv->motor_pwms[0] = NULL;
+            priv->motor_pwms[1] = NULL;
+            if (ix == 0 && (err == -ENODEV || err == -ENOENT))
+                return -ENODEV;
+            if (err != -EPROBE_DEFER)
+                dev_err(dev, "Failed to get '%s' pwm: %d", pwm_names[ix], err);
+            return err;
+        }
+        pwm_init_state(priv->motor_pwms[ix], &priv->motor_pwm_states[ix]);
+        priv->motor_pwm_states[ix].duty_cycle = 0;
+        priv->motor_pwm_states[ix].enabled = false;
+        err = pwm_apply_state(priv->motor_pwms[ix], &priv->motor_pwm_states[ix]);
+        if (err) {
+            dev_err(dev, "Failed to stop '%s' pwm: %d", pwm_names[ix], err);
+            return err;
+        }
+    }
+    return 0;
+}
+
+static int init_ear(struct device *dev, struct tagtagtagear_data *priv, struct class *ears_class, int major, int minor, const char* encoder_name, const char* motor_name, const char *const pwm_names[2]) {
     dev_t devno = MKDEV(major, minor);
+    struct ear_command *commands;
+    unsigned int depth;
     int err;
     int irq;
 
@@ -822,14 +2360,49 @@ static int init_ear(struct device *dev, struct tagtagtagear_data *priv, struct c
         return err;
     }
 
-    priv->motor_gpios = devm_gpiod_get_array(dev, motor_name, GPIOD_OUT_LOW);
-    if (IS_ERR(priv->motor_gpios)) {
-        err = PTR_ERR(priv->motor_gpios);
-        if (err != -EPROBE_DEFER)
-            dev_err(dev, "Failed to get 'motor' gpios for %s: %d", motor_name, err);
+    // Motors are driven by PWMs if available, GPIOs otherwise
+    err = init_motor_pwms(dev, priv, pwm_names);
+    if (err == -ENODEV) {
+        priv->motor_gpios = devm_gpiod_get_array(dev, motor_name, GPIOD_OUT_LOW);
+        if (IS_ERR(priv->motor_gpios)) {
+            err = PTR_ERR(priv->motor_gpios);
+            priv->motor_gpios = NULL;
+            if (err != -EPROBE_DEFER)
+                dev_err(dev, "Failed to get 'motor' gpios for %s: %d", motor_name, err);
+            return err;
+        }
+    } else if (err) {
         return err;
     }
 
+    // Setup command queue, lock and wait queues
+    depth = roundup_pow_of_two(max(queue_depth, 2U));
+    commands = devm_kcalloc(dev, depth, sizeof(*commands), GFP_KERNEL);
+    if (!commands)
+        return -ENOMEM;
+    kfifo_init(&priv->commands, commands, depth * sizeof(*commands));
+    INIT_KFIFO(priv->events);
+    INIT_KFIFO(priv->edges);
+    spin_lock_init(&priv->lock);
+    init_waitqueue_head(&priv->read_wq);
+    init_waitqueue_head(&priv->write_wq);
+
+    // Setup timers
+    hrtimer_init(&priv->broken_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+    priv->broken_timer.function = tagtagtagear_broken_timer_cb;
+    hrtimer_init(&priv->start_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+    priv->start_timer.function = tagtagtagear_start_timer_cb;
+    hrtimer_init(&priv->brake_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+    priv->brake_timer.function = tagtagtagear_brake_timer_cb;
+    hrtimer_init(&priv->stop_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+    priv->stop_timer.function = tagtagtagear_stop_timer_cb;
+    hrtimer_init(&priv->settle_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+    priv->settle_timer.function = tagtagtagear_settle_timer_cb;
+    hrtimer_init(&priv->retry_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+    priv->retry_timer.function = tagtagtagear_retry_timer_cb;
+    hrtimer_init(&priv->retest_timer, CLOCK_MONOTONIC, HRTIMER_MODE_REL_SOFT);
+    priv->retest_timer.function = tagtagtagear_retest_timer_cb;
+
     cdev_init(&priv->cdev, &ear_fops);
     err = cdev_add(&priv->cdev, devno, 1);
     if (err) {
@@ -837,7 +2410,7 @@ static int init_ear(struct device *dev, struct tagtagtagear_data *priv, struct c
         return err;
     }
 
-	priv->device = device_create(ears_class, dev, devno, NULL, /* no additional data */
+	priv->device = device_create_with_groups(ears_class, dev, devno, priv, ear_groups,
 		DEVICE_NAME "%d", minor);
 	if (IS_ERR(priv->device)) {
 		err = PTR_ERR(priv->device);
@@ -845,26 +2418,60 @@ static int init_ear(struct device *dev, struct tagtagtagear_data *priv, struct c
         return err;
     }
 
-    // Setup timer for broken ears
-    timer_setup(&priv->broken_timer, tagtagtagear_broken_timer_cb, TIMER_IRQSAFE);
-
     // Request interrupts from encoder GPIOs
     irq = gpiod_to_irq(priv->encoder_gpio);
-    err = devm_request_any_context_irq(dev, irq,
-                    tagtagtagear_irq_handler, IRQF_TRIGGER_FALLING,
+    err = devm_request_threaded_irq(dev, irq,
+                    tagtagtagear_irq_handler, tagtagtagear_irq_thread, IRQF_TRIGGER_FALLING,
                     DRV_NAME, priv);
     if (err < 0)
         return err;
+    priv->irq = irq;
 
-    // Setup wait queues
-    init_waitqueue_head(&priv->read_wq);
-    init_waitqueue_head(&priv->write_wq);
+    spin_lock_bh(&priv->lock);
+    if (fast_start || device_property_read_bool(dev, "fast-start")) {
+        transition_to_idle(priv, -1);
+    } else {
+        transition_to_testing(priv);
+    }
+    spin_unlock_bh(&priv->lock);
+
+    return 0;
+}
+
+static int init_combined(struct device *dev, struct tagtagtagears_data *priv, int major, int minor) {
+    dev_t devno = MKDEV(major, minor);
+    int ix;
+    int err;
+
+    if (priv->ear[0].motor_gpios && priv->ear[1].motor_gpios) {
+        for (ix = 0; ix < 4; ix++) {
+            priv->motor_descs[ix] = priv->ear[ix >> 1].motor_gpios->desc[ix & 1];
+        }
+    }
+    hrtimer_init(&priv->sync_timer, CLOCK_MONOTONIC, HRTIMER_MODE_ABS_SOFT);
+    priv->sync_timer.function = tagtagtagears_sync_timer_cb;
+
+    cdev_init(&priv->cdev, &ears_fops);
+    err = cdev_add(&priv->cdev, devno, 1);
+    if (err) {
+        dev_err(dev, "Failed to add cdev for %d: %d", minor, err);
+        return err;
+    }
 
-    transition_to_testing(priv);
+	priv->device = device_create(priv->ears_class, dev, devno, NULL, /* no additional data */
+		COMBINED_DEVICE_NAME);
+	if (IS_ERR(priv->device)) {
+		err = PTR_ERR(priv->device);
+        dev_err(dev, "Failed to create device for %d: %d", minor, err);
+        return err;
+    }
 
     return 0;
 }
 
+static const char *const left_pwm_names[2] = { "left-forward", "left-backward" };
+static const char *const right_pwm_names[2] = { "right-forward", "right-backward" };
+
 static int tagtagtagears_probe(struct platform_device *pdev) {
     struct device *dev = &pdev->dev;
     struct tagtagtagears_data *priv;
@@ -877,7 +2484,7 @@ static int tagtagtagears_probe(struct platform_device *pdev) {
     platform_set_drvdata(pdev, priv);
 
     // Register device.
-    err = alloc_chrdev_region(&priv->chrdev, 0, 2, DEVICE_NAME);
+    err = alloc_chrdev_region(&priv->chrdev, 0, 3, DEVICE_NAME);
     if (err < 0) {
         dev_err(dev, "Failed to registering character device: %d", err);
         tagtagtagears_remove(pdev);
@@ -893,20 +2500,27 @@ static int tagtagtagears_probe(struct platform_device *pdev) {
         return err;
 	}
 
-    err = init_ear(dev, &priv->ear[0], priv->ears_class, MAJOR(priv->chrdev), MINOR(priv->chrdev), "left-encoder", "left-motor");
+    err = init_ear(dev, &priv->ear[0], priv->ears_class, MAJOR(priv->chrdev), MINOR(priv->chrdev), "left-encoder", "left-motor", left_pwm_names);
     if (err < 0) {
         dev_err(dev, "init_ear failed for left ear: %d", err);
         tagtagtagears_remove(pdev);
         return err;
     }
 
-    err = init_ear(dev, &priv->ear[1], priv->ears_class, MAJOR(priv->chrdev), MINOR(priv->chrdev) + 1, "right-encoder", "right-motor");
+    err = init_ear(dev, &priv->ear[1], priv->ears_class, MAJOR(priv->chrdev), MINOR(priv->chrdev) + 1, "right-encoder", "right-motor", right_pwm_names);
     if (err < 0) {
         dev_err(dev, "init_ear failed for right ear: %d", err);
         tagtagtagears_remove(pdev);
         return err;
     }
 
+    err = init_combined(dev, priv, MAJOR(priv->chrdev), MINOR(priv->chrdev) + 2);
+    if (err < 0) {
+        dev_err(dev, "init_combined failed: %d", err);
+        tagtagtagears_remove(pdev);
+        return err;
+    }
+
     return 0;
 }
 
@@ -917,20 +2531,54 @@ static int tagtagtagears_remove(struct platform_device *pdev) {
 
     if (priv->chrdev) {
         if (priv->ears_class) {
+            if (priv->cdev.ops) {
+                park_ears(priv);
+                hrtimer_cancel(&priv->sync_timer);
+                device_destroy(priv->ears_class, MKDEV(MAJOR(priv->chrdev), MINOR(priv->chrdev) + 2));
+                cdev_del(&priv->cdev);
+            }
             for (ix = 1; ix >= 0; ix--) {
                 if (priv->ear[ix].cdev.ops) {
-                    del_timer_sync(&priv->ear[ix].broken_timer);
+                    // Free the interrupt first, as the threaded handler arms
+                    // timers, then cancel timers that start motors, as they
+                    // arm the others.
+                    if (priv->ear[ix].irq > 0) {
+                        devm_free_irq(&pdev->dev, priv->ear[ix].irq, &priv->ear[ix]);
+                        priv->ear[ix].irq = 0;
+                    }
+                    hrtimer_cancel(&priv->ear[ix].retest_timer);
+                    hrtimer_cancel(&priv->ear[ix].retry_timer);
+                    hrtimer_cancel(&priv->ear[ix].start_timer);
+                    hrtimer_cancel(&priv->ear[ix].stop_timer);
+                    hrtimer_cancel(&priv->ear[ix].settle_timer);
+                    hrtimer_cancel(&priv->ear[ix].broken_timer);
+                    hrtimer_cancel(&priv->ear[ix].brake_timer);
+                    // Motors still run if the ear was not parked. Release
+                    // them without braking, as brake_timer must stay idle.
+                    spin_lock_bh(&priv->ear[ix].lock);
+                    priv->ear[ix].braking = false;
+                    priv->ear[ix].motors_deferred = 0;
+                    set_motors(&priv->ear[ix], 0, 0);
+                    motors_stopped(&priv->ear[ix]);
+                    spin_unlock_bh(&priv->ear[ix].lock);
                     device_destroy(priv->ears_class, MKDEV(MAJOR(priv->chrdev), MINOR(priv->chrdev) + ix));
                     cdev_del(&priv->ear[ix].cdev);
                 }
             }
             class_destroy(priv->ears_class);
         }
-        unregister_chrdev_region(priv->chrdev, 2);
+        unregister_chrdev_region(priv->chrdev, 3);
     }
     return 0;
 }
 
+static void tagtagtagears_shutdown(struct platform_device *pdev) {
+    struct tagtagtagears_data *priv = platform_get_drvdata(pdev);
+    if (priv->cdev.ops) {
+        park_ears(priv);
+    }
+}
+
 #ifdef CONFIG_OF
 static const struct of_device_id tagtagtagears_ids[] = {
     { .compatible = "linux,tagtagtag-ears", },
@@ -946,6 +2594,7 @@ static struct platform_driver tagtagtagears_driver = {
     },
     .probe              = tagtagtagears_probe,
     .remove             = tagtagtagears_remove,
+    .shutdown           = tagtagtagears_shutdown,
 };
 
 module_platform_driver(tagtagtagears_driver);
@@ -953,3 +2602,7 @@ module_platform_driver(tagtagtagears_driver);
 MODULE_DESCRIPTION("Nabaztagtagtag ears driver");
 MODULE_AUTHOR("Paul Guyot <pguyot@kallisys.net>");
 MODULE_LICENSE("GPL");
+
+#if IS_ENABLED(CONFIG_TAGTAGTAG_EARS_KUNIT_TEST)
+#include "tagtagtag-ears-test.c"
+#endif
@@ -0,0 +1,37 @@
+/* SPDX-License-Identifier: GPL-2.0 WITH Linux-syscall-note */
+// Userspace interface of the tagtagtag ears driver.
+// See README.md for the command protocol.
+
+#ifndef TAGTAGTAG_EARS_H
+#define TAGTAGTAG_EARS_H
+
+#include <linux/types.h>
+
+// Event types
+#define EAR_EVENT_MOVED     'm'     // ear was moved by user, position is unknown
+#define EAR_EVENT_POSITION  'p'     // answer to a get position command ('?' or '!')
+#define EAR_EVENT_DONE      'd'     // a command completed
+#define EAR_EVENT_BROKEN    'b'     // ear failed its test, commands fail until it is tested again
+#define EAR_EVENT_RECOVERED 'r'     // broken ear passed its test again, with its position
+
+// Flags of EAR_EVENT_DONE
+#define EAR_DONE_DETECTION  0x01    // a position detection was performed
+#define EAR_DONE_CORRECTION 0x02    // ear overran and a correction move was performed
+#define EAR_DONE_FAILED     0x04    // ear did not reach a hole in time, position is unknown
+#define EAR_DONE_RESYNC     0x08    // position was corrected when crossing the gap
+#define EAR_DONE_RETRY      0x10    // ear stalled and the move was retried
+
+// Event, as read from /dev/ear* after the 'e' command was written.
+struct ear_event {
+    __u64 time_ns;          // CLOCK_MONOTONIC
+    __u64 start_time_ns;    // EAR_EVENT_DONE: when command started executing (CLOCK_MONOTONIC)
+    __u32 sequence;         // sequence number of the command, 0 if not caused by a command
+    __u32 motors_on_us;     // EAR_EVENT_DONE: how long motors were on
+    __u8 type;              // EAR_EVENT_*
+    __s8 position;          // -1 (unknown) or 0-16
+    __u8 command;           // EAR_EVENT_DONE: command character
+    __u8 flags;             // EAR_EVENT_DONE: EAR_DONE_*
+    __u8 reserved[4];
+};
+
+#endif